@@ -6,6 +6,9 @@
 #define PIN_DALI_O 5 // D1
 #define PIN_DALI_I 4 // D2
 
+#define MAX_LAMPS 64
+#define MAX_INPUT_DEVICES 64
+
 #define LED_ACTIVE LOW
 #define LED_INACTIVE HIGH
 
@@ -16,11 +19,14 @@ typedef enum {
   blinkQueryPowerOnLevelFailed,
   blinkPowerOnLevelSetFailed,
   blinkOTAFailed,
+  blinkQueryGroupsFailed,
 } blinkLongCode;
 
-Dali *dali;
-daliAddr *addrs;
+Dali<MAX_LAMPS> dali(PIN_DALI_I, PIN_DALI_O);
+daliAddr addrs[MAX_LAMPS];
 byte nLamps;
+daliAddr devAddrs[MAX_INPUT_DEVICES];
+byte nDevs;
 
 // RTC memory gives us 512 bytes, so these 33+1+1+1+64+4=104 will fit fine
 struct __attribute__((packed, aligned(4))) DaliFiConfig {
@@ -32,27 +38,30 @@ struct __attribute__((packed, aligned(4))) DaliFiConfig {
   uint32_t crc;       // CRC to ensure the data we read is valid
 } daliFiConfig;
 
-void blinkCode(blinkLongCode longFlash, byte shortFlash, const char* logBuf) {
+void blinkCode(blinkLongCode longFlash, byte shortFlash, const char* msg) {
+  if (msg) {
+    dali.log("%s\n", msg);
+  }
   for (byte x=0; x != 4; x++) {
     for (byte i = 0; i != (byte)longFlash; i++) {
       digitalWrite(PIN_LED_BUILTIN, LED_ACTIVE);
       delay(600);
-      serveWiFi(logBuf);
+      serveWiFi();
       digitalWrite(PIN_LED_BUILTIN, LED_INACTIVE);
       delay(600);
-      serveWiFi(logBuf);
+      serveWiFi();
     }
     delay(1000);
     for (byte i = 0; i != shortFlash; i++) {
       digitalWrite(PIN_LED_BUILTIN, LED_ACTIVE);
       delay(200);
-      serveWiFi(logBuf);
+      serveWiFi();
       digitalWrite(PIN_LED_BUILTIN, LED_INACTIVE);
       delay(300);
-      serveWiFi(logBuf);
+      serveWiFi();
     }
     delay(2000);
-    serveWiFi(logBuf);
+    serveWiFi();
   }
   ESP.restart();
 }
@@ -65,43 +74,49 @@ void setup() {
   digitalWrite(PIN_LED_BUILTIN, LED_INACTIVE);
   setupWiFi();
 
-  dali = new Dali(PIN_DALI_I, PIN_DALI_O);
-  dali->init();
-  dali->log("init\n");
+  dali.init();
+  dali.log("init\n");
   delay(2000);
-  if (!dali->sendReset(Dali::broadcast)) {
-    blinkCode(blinkResetFailed, dali->getError(), dali->getLogBuf());
+  if (!dali.sendReset(DaliBus::broadcast)) {
+    blinkCode(blinkResetFailed, dali.getError(), NULL);
   }
-  dali->log("reset sent\n");
+  dali.log("reset sent\n");
   delay(1000);
-  if (!dali->sendLampOff(Dali::broadcast, false)) {
-    blinkCode(blinkLampOffFailed, dali->getError(), dali->getLogBuf());
+  if (!dali.sendLampOff(DaliBus::broadcast, false)) {
+    blinkCode(blinkLampOffFailed, dali.getError(), NULL);
   }
-  dali->log("lamp-off sent\n");
+  dali.log("lamp-off sent\n");
   digitalWrite(PIN_LED_BUILTIN, LED_ACTIVE);
   delay(200);
   digitalWrite(PIN_LED_BUILTIN, LED_INACTIVE);
   delay(2000);
-  addrs = dali->reAddressLamps(&nLamps);
-  dali->log("lamps addressed, nLamps %d\n", nLamps);
-  if (addrs == NULL || nLamps != daliFiConfig.nLamps) {
-    blinkCode(blinkNotAllLampsFound, dali->getError(), dali->getLogBuf());
+  nLamps = dali.reAddressLamps(addrs, MAX_LAMPS);
+  dali.log("lamps addressed, nLamps %d\n", nLamps);
+  if (nLamps == 0 || nLamps != daliFiConfig.nLamps) {
+    blinkCode(blinkNotAllLampsFound, dali.getError(), NULL);
   }
   for (int i = 0; i < nLamps; i++) {
-    int pol = dali->queryPowerOnLevel(addrs[i], false);
+    int pol = dali.queryPowerOnLevel(addrs[i], false);
     if (pol < 0) {
-      blinkCode(blinkQueryPowerOnLevelFailed, dali->getError(), dali->getLogBuf());
+      blinkCode(blinkQueryPowerOnLevelFailed, dali.getError(), NULL);
+    }
+    dali.log("lamp %d, got pol %d, want %d\n", i, pol, daliFiConfig.powerOnLvl);
+    // Knowing group membership lets colour changes and health checks address lamps by group
+    if (dali.queryGroups(addrs[i], false) < 0) {
+      blinkCode(blinkQueryGroupsFailed, dali.getError(), NULL);
     }
-    dali->log("lamp %d, got pol %d, want %d\n", i, pol, daliFiConfig.powerOnLvl);
     if (pol == daliFiConfig.powerOnLvl) {
       // Power-on level already set to what we want, next lamp
       continue;
     }
-    if (!dali->sendSetPowerOnLevel(addrs[i], false, daliFiConfig.powerOnLvl)) {
-      blinkCode(blinkPowerOnLevelSetFailed, dali->getError(), dali->getLogBuf());
+    if (!dali.sendSetPowerOnLevel(addrs[i], false, daliFiConfig.powerOnLvl)) {
+      blinkCode(blinkPowerOnLevelSetFailed, dali.getError(), NULL);
     }
   }
-  dali->log("boot complete, %d lamps\n", nLamps);
+  // Input devices (buttons, sensors) are optional, so not finding any isn't an error
+  nDevs = dali.reAddressInputDevices(devAddrs, MAX_INPUT_DEVICES);
+  dali.log("input devices addressed, nDevs %d\n", nDevs);
+  dali.log("boot complete, %d lamps\n", nLamps);
 }
 
 byte getNumLamps(void) {
@@ -110,7 +125,7 @@ byte getNumLamps(void) {
 
 const char *stepOnUp(bool fromUser) {
   for (int i = 0; i < nLamps; i++) {
-    if (!dali->sendOnStepUp(addrs[i], fromUser)) {
+    if (!dali.sendOnStepUp(addrs[i], fromUser)) {
       return "Failed OSU";
     }
   }
@@ -119,7 +134,7 @@ const char *stepOnUp(bool fromUser) {
 
 const char *stepDownOff(bool fromUser) {
   for (int i = 0; i < nLamps; i++) {
-    if (!dali->sendStepDownOff(addrs[i], fromUser)) {
+    if (!dali.sendStepDownOff(addrs[i], fromUser)) {
       return "Failed SDO";
     }
   }
@@ -128,7 +143,7 @@ const char *stepDownOff(bool fromUser) {
 
 const char *setLevel(bool fromUser, byte level) {
   for (int i = 0; i < nLamps; i++) {
-    if (!dali->sendDapc(addrs[i], fromUser, level)) {
+    if (!dali.sendDapc(addrs[i], fromUser, level)) {
       return "Failed DAPC";
     }
   }
@@ -137,7 +152,7 @@ const char *setLevel(bool fromUser, byte level) {
 
 const char *query(bool fromUser, int *lvl) {
   for (int i = 0; i < nLamps; i++) {
-    lvl[i] = dali->queryActualLevel(addrs[i], fromUser);
+    lvl[i] = dali.queryActualLevel(addrs[i], fromUser);
     if (lvl[i] < 0) {
       return "Failed QAL";
     }
@@ -147,7 +162,7 @@ const char *query(bool fromUser, int *lvl) {
 
 const char *queryMin(bool fromUser, int *lvl) {
   for (int i = 0; i < nLamps; i++) {
-    lvl[i] = dali->queryMinLevel(addrs[i], fromUser);
+    lvl[i] = dali.queryMinLevel(addrs[i], fromUser);
     if (lvl[i] < 0) {
       return "Failed QMinL";
     }
@@ -157,7 +172,7 @@ const char *queryMin(bool fromUser, int *lvl) {
 
 const char *queryMax(bool fromUser, int *lvl) {
   for (int i = 0; i < nLamps; i++) {
-    lvl[i] = dali->queryMaxLevel(addrs[i], fromUser);
+    lvl[i] = dali.queryMaxLevel(addrs[i], fromUser);
     if (lvl[i] < 0) {
       return "Failed QMaxL";
     }
@@ -165,6 +180,70 @@ const char *queryMax(bool fromUser, int *lvl) {
   return NULL;
 }
 
+const char *setColourTemp(bool fromUser, long kelvin) {
+  // DT8 takes the colour temperature in mirek, 1-65534 (65535 means "mask")
+  if (kelvin <= 0) {
+    return "Bad Tc";
+  }
+  unsigned long mirek = 1000000UL / kelvin;
+  if (mirek < 1 || mirek > 65534) {
+    return "Bad Tc";
+  }
+  daliColour col = {};
+  col.type = colTc;
+  col.tc = mirek;
+  daliColour cols[MAX_LAMPS];
+  for (int i = 0; i < nLamps; i++) {
+    cols[i] = col;
+  }
+  if (!dali.sendColours(addrs, cols, nLamps, fromUser)) {
+    return "Failed Tc";
+  }
+  return NULL;
+}
+
+const char *checkHealth(bool fromUser, uint64 *failed) {
+  if (!dali.sweepQuery(msgQueryLampFailure, fromUser, failed)) {
+    return "Failed QLF";
+  }
+  return NULL;
+}
+
+const char *bisectionGroups(byte firstGroup) {
+  if (!dali.assignBisectionGroups(firstGroup, true)) {
+    return "Failed ABG";
+  }
+  return NULL;
+}
+
+const char *readBank0(bool fromUser, byte lamp, byte *buf, int *len) {
+  *len = dali.readMemoryBank(addrs[lamp], fromUser, 0, buf, DALI_BANK0_SIZE);
+  if (*len < 0) {
+    return "Failed RMB";
+  }
+  return NULL;
+}
+
+const char *addRule(const char *spec) {
+  int device, instNum, info, target, action, value;
+  if (sscanf(spec, "%d,%d,%d,%d,%d,%d", &device, &instNum, &info, &target, &action, &value) != 6) {
+    return "Bad rule";
+  }
+  daliEventRule rule = {(signed char)device, (signed char)instNum, (uint16)info, (daliAddr)target, (daliRuleAction)action, (byte)value};
+  if (!dali.addEventRule(&rule)) {
+    return "Too many rules";
+  }
+  return NULL;
+}
+
+void handleEvents() {
+  daliEvent ev;
+  while (dali.handleEvent(&ev)) {
+    dali.log("event s %d d %d g %d t %d n %d i %03X\n", ev.scheme, ev.device, ev.group, ev.instType, ev.instNum, ev.info);
+  }
+}
+
 void loop() {
-  serveWiFi(dali->getLogBuf());
+  handleEvents();
+  serveWiFi();
 }
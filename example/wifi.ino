@@ -17,7 +17,7 @@ void setupWiFi() {
   setupArduinoOTA();
 }
 
-void serveWiFi(const char* log) {
+void serveWiFi() {
   handleArduinoOTA();
   WiFiClient client = server.available();
   if (!client) {
@@ -26,6 +26,7 @@ void serveWiFi(const char* log) {
   while (client.connected())
   {
     yield();
+    handleEvents();
     if (client.available())
     {
       char cmdbuf[101];
@@ -41,8 +42,22 @@ void serveWiFi(const char* log) {
       if (!strcmp(cmdbuf, "RESET")) {
         ESP.restart();
         delayMicroseconds(10000000);
-      } else if (!strcmp(cmdbuf, "LOG")) {
-        client.write(log, strlen(log));
+      } else if (!strcmp(cmdbuf, "LOG") || !strncmp(cmdbuf, "LOG ", 4)) {
+        // "LOG <cursor>" returns only what's been logged since the cursor, followed by
+        // the cursor to use next time.  Plain "LOG" returns everything still buffered.
+        // "LOST" before the cursor means some of what was logged since the cursor is missing.
+        uint32 cursor = l > 4 ? strtoul(cmdbuf + 4, NULL, 10) : 0;
+        const char *chunk1, *chunk2;
+        size_t len1, len2;
+        uint32 next = dali.getLog(cursor, &chunk1, &len1, &chunk2, &len2);
+        uint32 start = next - len1 - len2;
+        client.write(chunk1, len1);
+        client.write(chunk2, len2);
+        if ((l > 4 && start != cursor) || dali.logOverwritten(start)) {
+          client.write("LOST\n", 5);
+        }
+        l = sprintf(cmdbuf, "NEXT %u\n", next);
+        client.write(cmdbuf, l);
       } else if (!strcmp(cmdbuf, "STARTINFO")) {
         rst_info *rst;
         rst = ESP.getResetInfoPtr();
@@ -77,7 +92,7 @@ void serveWiFi(const char* log) {
         if (!err) {
           client.write("OK\n", 3);
         } else {
-          l = sprintf(cmdbuf, "ERR:%d/%s\n", dali->getError(), err);
+          l = sprintf(cmdbuf, "ERR:%d/%s\n", dali.getError(), err);
           client.write(cmdbuf, l);
         }
       } else if (!strncmp(cmdbuf, "SET ", 4)) {
@@ -86,11 +101,20 @@ void serveWiFi(const char* log) {
         if (!err) {
           client.write("OK\n", 3);
         } else {
-          l = sprintf(cmdbuf, "ERR:%d/%s\n", dali->getError(), err);
+          l = sprintf(cmdbuf, "ERR:%d/%s\n", dali.getError(), err);
+          client.write(cmdbuf, l);
+        }
+      } else if (!strncmp(cmdbuf, "TC ", 3)) {
+        // Colour temperature in Kelvin, for all lamps
+        const char* err = setColourTemp(true, atol(cmdbuf + 3));
+        if (!err) {
+          client.write("OK\n", 3);
+        } else {
+          l = sprintf(cmdbuf, "ERR:%d/%s\n", dali.getError(), err);
           client.write(cmdbuf, l);
         }
       } else if (!strcmp(cmdbuf, "QUERY")) {
-        int *lvl = (int*)malloc(sizeof(int) * getNumLamps());
+        int lvl[MAX_LAMPS];
         const char* err = query(true, lvl);
         if (!err) {
           l = 0;
@@ -100,12 +124,11 @@ void serveWiFi(const char* log) {
           cmdbuf[l++] = '\n';
           client.write(cmdbuf, l);
         } else {
-          l = sprintf(cmdbuf, "ERR:%d/%s\n", dali->getError(), err);
+          l = sprintf(cmdbuf, "ERR:%d/%s\n", dali.getError(), err);
           client.write(cmdbuf, l);
         }
-        free(lvl);
       } else if (!strcmp(cmdbuf, "QUERY_MIN")) {
-        int *lvl = (int*)malloc(sizeof(int) * getNumLamps());
+        int lvl[MAX_LAMPS];
         const char* err = queryMin(true, lvl);
         if (!err) {
           l = 0;
@@ -115,12 +138,11 @@ void serveWiFi(const char* log) {
           cmdbuf[l++] = '\n';
           client.write(cmdbuf, l);
         } else {
-          l = sprintf(cmdbuf, "ERR:%d/%s\n", dali->getError(), err);
+          l = sprintf(cmdbuf, "ERR:%d/%s\n", dali.getError(), err);
           client.write(cmdbuf, l);
         }
-        free(lvl);
       } else if (!strcmp(cmdbuf, "QUERY_MAX")) {
-        int *lvl = (int*)malloc(sizeof(int) * getNumLamps());
+        int lvl[MAX_LAMPS];
         const char* err = queryMax(true, lvl);
         if (!err) {
           l = 0;
@@ -130,16 +152,78 @@ void serveWiFi(const char* log) {
           cmdbuf[l++] = '\n';
           client.write(cmdbuf, l);
         } else {
-          l = sprintf(cmdbuf, "ERR:%d/%s\n", dali->getError(), err);
+          l = sprintf(cmdbuf, "ERR:%d/%s\n", dali.getError(), err);
+          client.write(cmdbuf, l);
+        }
+      } else if (!strcmp(cmdbuf, "HEALTH")) {
+        // Lists the lamps reporting a lamp failure
+        uint64 failed;
+        const char* err = checkHealth(true, &failed);
+        if (!err) {
+          l = sprintf(cmdbuf, "FAILED:");
+          bool first = true;
+          for (int i = 0; i < getNumLamps(); i++) {
+            if (failed & ((uint64)1 << (addrs[i] >> 1))) {
+              if (l > (int)sizeof(cmdbuf) - 5) {
+                // Leave room for ",63\n"
+                client.write(cmdbuf, l);
+                l = 0;
+              }
+              l += sprintf(cmdbuf + l, "%s%d", first ? "" : ",", i);
+              first = false;
+            }
+          }
+          cmdbuf[l++] = '\n';
+          client.write(cmdbuf, l);
+        } else {
+          l = sprintf(cmdbuf, "ERR:%d/%s\n", dali.getError(), err);
+          client.write(cmdbuf, l);
+        }
+      } else if (!strncmp(cmdbuf, "BISECT_GROUPS ", 14)) {
+        // Uses groups from the given one up to narrow down HEALTH: 2 groups per short address bit
+        const char* err = bisectionGroups(atoi(cmdbuf + 14));
+        if (!err) {
+          client.write("OK\n", 3);
+        } else {
+          l = sprintf(cmdbuf, "ERR:%d/%s\n", dali.getError(), err);
+          client.write(cmdbuf, l);
+        }
+      } else if (!strcmp(cmdbuf, "INVENTORY")) {
+        // One line per lamp: the raw content of memory bank 0 (GTIN, firmware, serial etc.)
+        byte bank0[DALI_BANK0_SIZE];
+        int n;
+        for (int i = 0; i < getNumLamps(); i++) {
+          const char* err = readBank0(true, i, bank0, &n);
+          if (!err) {
+            l = sprintf(cmdbuf, "%d:", i);
+            for (int j = 0; j < n; j++) {
+              l += sprintf(cmdbuf + l, "%02X", bank0[j]);
+            }
+            cmdbuf[l++] = '\n';
+          } else {
+            l = sprintf(cmdbuf, "ERR:%d/%s\n", dali.getError(), err);
+          }
+          client.write(cmdbuf, l);
+        }
+      } else if (!strncmp(cmdbuf, "RULE ", 5)) {
+        // RULE <device>,<instance>,<event info>,<target addr>,<action>,<value>
+        // Device and instance may be -1 to match any
+        const char* err = addRule(cmdbuf + 5);
+        if (!err) {
+          client.write("OK\n", 3);
+        } else {
+          l = sprintf(cmdbuf, "ERR:%s\n", err);
           client.write(cmdbuf, l);
         }
-        free(lvl);
+      } else if (!strcmp(cmdbuf, "CLEAR_RULES")) {
+        dali.clearEventRules();
+        client.write("OK\n", 3);
       } else if (!strcmp(cmdbuf, "STEP_DOWN_OFF")) {
         const char* err = stepDownOff(true);
         if (!err) {
           client.write("OK\n", 3);
         } else {
-          l = sprintf(cmdbuf, "ERR:%d/%s\n", dali->getError(), err);
+          l = sprintf(cmdbuf, "ERR:%d/%s\n", dali.getError(), err);
           client.write(cmdbuf, l);
         }
       } else if (!strcmp(cmdbuf, "QUIT")) {
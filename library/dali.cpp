@@ -1,6 +1,10 @@
 #include "Arduino.h"
 #include "PolledTimeout.h"
 #include "dali.h"
+#include "manchester.h"
+#ifdef DALI_TX_I2S
+#include <i2s.h>
+#endif
 
 // The times below are 30us more generous than the standard.  The slow zener diode usually means
 // we end up at the long end for high halfbits and the short end for low halfbits.
@@ -12,37 +16,55 @@
 #define STOP_BIT_TICKS 750  // 750 * 3.2us = 2400us = stop bit time
 #define DALI_HIGH() digitalWrite(this->pinOut, LOW)
 #define DALI_LOW() digitalWrite(this->pinOut, HIGH)
-#define LOG_SIZE 4096
+#define LOG_LINE_MAX 100
+// For I2S, each half-bit is sent as 8 all-ones or all-zeros 32-bit samples.  Any more and a
+// frame wouldn't fit in the I2S DMA buffers, any fewer and the wait for the buffer currently
+// being output to finish (up to 64 samples) gets long.
+#define DALI_I2S_SAMPLES_PER_HB 8
+#define DALI_I2S_RATE (2400 * DALI_I2S_SAMPLES_PER_HB)
+#define DALI_I2S_ACTIVE 0xFFFFFFFF // The output pin goes high to pull the bus low
+#define DALI_I2S_IDLE 0x00000000
+#define DALI_I2S_BUF_SAMPLES 64 // The size of each of the ESP8266 core's I2S DMA buffers
+#define DALI_I2S_BUF_US (DALI_I2S_BUF_SAMPLES * 1000000UL / DALI_I2S_RATE)
 
 
 // These are all "special" addresses. They're outside the range of normal short addresses
 // and are (largely) used for sending commands with data.  Essentially, for those commands,
 // the address is the opcode and the opcode byte is used for data.
-const daliAddr Dali::broadcast              = (daliAddr)0xFF;
+const daliAddr DaliBus::broadcast              = (daliAddr)0xFF;
 
-const daliAddr Dali::addrTerminate          = (daliAddr)0xa1;
-const daliAddr Dali::addrDTR0               = (daliAddr)0xa3;
-const daliAddr Dali::addrInitialise         = (daliAddr)0xa5;
-const daliAddr Dali::addrRandomise          = (daliAddr)0xa7;
-const daliAddr Dali::addrCompare            = (daliAddr)0xa9;
-const daliAddr Dali::addrWithdraw           = (daliAddr)0xab;
-const daliAddr Dali::addrPing               = (daliAddr)0xad;
+const daliAddr DaliBus::addrTerminate          = (daliAddr)0xa1;
+const daliAddr DaliBus::addrDTR0               = (daliAddr)0xa3;
+const daliAddr DaliBus::addrInitialise         = (daliAddr)0xa5;
+const daliAddr DaliBus::addrRandomise          = (daliAddr)0xa7;
+const daliAddr DaliBus::addrCompare            = (daliAddr)0xa9;
+const daliAddr DaliBus::addrWithdraw           = (daliAddr)0xab;
+const daliAddr DaliBus::addrPing               = (daliAddr)0xad;
 
-const daliAddr Dali::addrSearchAddrH        = (daliAddr)0xb1;
-const daliAddr Dali::addrSearchAddrM        = (daliAddr)0xb3;
-const daliAddr Dali::addrSearchAddrL        = (daliAddr)0xb5;
-const daliAddr Dali::addrProgramShortAddr   = (daliAddr)0xb7;
-const daliAddr Dali::addrVerifyShortAddr    = (daliAddr)0xb9;
-const daliAddr Dali::addrQueryShortAddr     = (daliAddr)0xbb;
+const daliAddr DaliBus::addrSearchAddrH        = (daliAddr)0xb1;
+const daliAddr DaliBus::addrSearchAddrM        = (daliAddr)0xb3;
+const daliAddr DaliBus::addrSearchAddrL        = (daliAddr)0xb5;
+const daliAddr DaliBus::addrProgramShortAddr   = (daliAddr)0xb7;
+const daliAddr DaliBus::addrVerifyShortAddr    = (daliAddr)0xb9;
+const daliAddr DaliBus::addrQueryShortAddr     = (daliAddr)0xbb;
 
-const daliAddr Dali::addrEnableDeviceType   = (daliAddr)0xc1;
-const daliAddr Dali::addrDTR1               = (daliAddr)0xc3;
-const daliAddr Dali::addrDTR2               = (daliAddr)0xc5;
-const daliAddr Dali::addrWriteMemLoc        = (daliAddr)0xc7;
-const daliAddr Dali::addrWriteMemLocNoReply = (daliAddr)0xc7;
+const daliAddr DaliBus::addrEnableDeviceType   = (daliAddr)0xc1;
+const daliAddr DaliBus::addrDTR1               = (daliAddr)0xc3;
+const daliAddr DaliBus::addrDTR2               = (daliAddr)0xc5;
+const daliAddr DaliBus::addrWriteMemLoc        = (daliAddr)0xc7;
+const daliAddr DaliBus::addrWriteMemLocNoReply = (daliAddr)0xc7;
 
 
-Dali *Dali::d;
+DaliBus *DaliBus::d;
+
+#ifdef DALI_TX_I2S
+// When the I2S DMA last started outputting a buffer
+static volatile unsigned long i2sBufStarted;
+
+static void IRAM_ATTR i2sBufferDone(void) {
+  i2sBufStarted = micros();
+}
+#endif
 
 // The input from the device is received as level-change interrupts.
 // Additionally, the timeout while waiting for a stop bit is received as a timer interrupt.
@@ -50,61 +72,131 @@ Dali *Dali::d;
 // as well as the (small) tree of functions they can be called by is marked with IRAM_ATTR, which
 // indicates they should be kept in RAM.
 
-void IRAM_ATTR Dali::inputISR(void) {
-  if (digitalRead(Dali::d->pinIn) == LOW) {
-    Dali::d->daliHigh();
+void IRAM_ATTR DaliBus::inputISR(void) {
+  if (digitalRead(DaliBus::d->pinIn) == LOW) {
+    DaliBus::d->daliHigh();
   } else {
-    Dali::d->daliLow();
+    DaliBus::d->daliLow();
   }
 }
 
-void IRAM_ATTR Dali::timerISR(void) {
+void IRAM_ATTR DaliBus::timerISR(void) {
   // When the timer interval triggers, we've finished receiving bits - a stop bit has been seen
-  Dali::d->daliIdle();
+  DaliBus::d->daliIdle();
 }
 
-Dali::Dali(int pinIn, int pinOut) {
+DaliBus::DaliBus(int pinIn, int pinOut, char *logBuf, uint32 logSize,
+                 unsigned long *edgeTimes, bool *edgeDests, daliState *edgeStates, int edgeSlots,
+                 daliBank0Entry *bank0Cache, byte bank0CacheSize) {
   this->pinIn = pinIn;
   this->pinOut = pinOut;
   this->err = eNoError;
 
-  this->logBuf = (char*)malloc(LOG_SIZE);
-  this->logPtr = logBuf;
-  this->edgeTimes = (unsigned long*)malloc(100*sizeof(unsigned long));
-  this->edgeDests = (bool*)malloc(100*sizeof(bool));
-  this->edgeStates = (daliState*)malloc(100*sizeof(daliState));
+  this->logBuf = logBuf;
+  this->logSize = logSize;
+  this->logHead = 0;
+  this->edgeTimes = edgeTimes;
+  this->edgeDests = edgeDests;
+  this->edgeStates = edgeStates;
+  this->edgeSlots = edgeSlots;
   this->nEdges = 0;
+  this->bank0Cache = bank0Cache;
+  this->bank0CacheSize = bank0CacheSize;
+  this->nBank0Cached = 0;
+  this->evHead = 0;
+  this->evTail = 0;
+  this->longFrames = 0;
+  this->nRules = 0;
+  forgetDtrs();
+  this->randomKnown = 0;
+  this->gearMask = 0;
+  this->groupsKnown = 0;
   
-  Dali::d = this;
+  DaliBus::d = this;
 }
 
-void IRAM_ATTR Dali::log(const char* fmt, ...) {
+// The log is a ring buffer.  logHead counts every byte ever logged, so a byte's position in the
+// buffer is its cursor modulo logSize.  Lines are formatted on the stack first so that they can
+// be split across the end of the buffer.  Space is reserved with interrupts disabled, so a line
+// logged from an ISR while we're copying gets its own space rather than sharing ours.
+void IRAM_ATTR DaliBus::log(const char* fmt, ...) {
+  char line[LOG_LINE_MAX];
   va_list ap;
   va_start(ap, fmt);
-  int l = vsnprintf(this->logPtr, LOG_SIZE - (this->logPtr - this->logBuf), fmt, ap);
-  this->logPtr += l;
-  if (this->logPtr - this->logBuf > (LOG_SIZE - 100)) {
-    this->logPtr = this->logBuf;
-  }
+  int l = vsnprintf(line, LOG_LINE_MAX, fmt, ap);
   va_end(ap);
+  if (l <= 0) {
+    return;
+  }
+  if (l >= LOG_LINE_MAX) {
+    l = LOG_LINE_MAX - 1;
+  }
+  uint32 ps = xt_rsil(15);
+  uint32 head = this->logHead;
+  this->logHead = head + l;
+  xt_wsr_ps(ps);
+  uint32 pos = head % this->logSize;
+  uint32 first = this->logSize - pos;
+  if (first > (uint32)l) {
+    first = l;
+  }
+  memcpy(this->logBuf + pos, line, first);
+  memcpy(this->logBuf, line + first, l - first);
 }
 
-const char* Dali::getLogBuf(void) {
-  return this->logBuf;
+// getLog finds everything logged since cursor, without copying it.  The log is returned as up to
+// two chunks of the ring buffer (chunk2 is only non-empty if the log wraps), which should be
+// output in order.  The return value is the cursor to pass next time.  If cursor is too old
+// (or from before a restart), the oldest complete lines still in the buffer are returned; the
+// cursor they start at is next - *len1 - *len2.  Lines logged from an ISR while the chunks are
+// being output can overwrite them, so check logOverwritten afterwards.
+uint32 DaliBus::getLog(uint32 cursor, const char **chunk1, size_t *len1, const char **chunk2, size_t *len2) {
+  uint32 head = this->logHead;
+  // Leave a line's worth of the buffer out, so that it takes at least two more lines to
+  // overwrite what we return
+  uint32 avail = head < this->logSize - LOG_LINE_MAX ? head : this->logSize - LOG_LINE_MAX;
+  if (head - cursor > avail) {
+    cursor = head - avail;
+    if (cursor != 0) {
+      // We're probably mid-line, skip to the start of the next one
+      while (cursor != head && this->logBuf[(cursor - 1) % this->logSize] != '\n') {
+        cursor++;
+      }
+    }
+  }
+  uint32 pos = cursor % this->logSize;
+  size_t l = head - cursor;
+  size_t first = this->logSize - pos;
+  if (first > l) {
+    first = l;
+  }
+  *chunk1 = this->logBuf + pos;
+  *len1 = first;
+  *chunk2 = this->logBuf;
+  *len2 = l - first;
+  return head;
+}
+
+// logOverwritten returns true if anything logged since cursor has since been overwritten.
+bool DaliBus::logOverwritten(uint32 cursor) {
+  return this->logHead - cursor > this->logSize;
 }
 
-void Dali::resetEdgeLog(void) {
+void DaliBus::resetEdgeLog(void) {
   nEdges = 0;
 }
 
-void IRAM_ATTR Dali::logEdge(unsigned long t, bool v, daliState s) {
+void IRAM_ATTR DaliBus::logEdge(unsigned long t, bool v, daliState s) {
+  if (nEdges == edgeSlots) {
+    return;
+  }
   edgeTimes[nEdges] = t;
   edgeDests[nEdges] = v;
   edgeStates[nEdges] = s;
   nEdges++;
 }
 
-void Dali::dumpEdgeLog(const char *tag) {
+void DaliBus::dumpEdgeLog(const char *tag) {
   log("%s: b %d v %02X\n", tag, rcvdBits, rcvdVal);
   unsigned long lastT = edgeTimes[0];
   for (int i = 0; i < nEdges; i++) {
@@ -113,23 +205,29 @@ void Dali::dumpEdgeLog(const char *tag) {
   }
 }
 
-void Dali::init(void) {
+void DaliBus::init(void) {
   pinMode(this->pinIn, INPUT);
+  attachInterrupt(digitalPinToInterrupt(this->pinIn), DaliBus::inputISR, CHANGE);
+  timer1_attachInterrupt(DaliBus::timerISR);
+#ifdef DALI_TX_I2S
+  i2s_rxtx_begin(false, true);
+  i2s_set_rate(DALI_I2S_RATE);
+  i2s_set_callback(i2sBufferDone);
+#else
   pinMode(this->pinOut, OUTPUT);
-  attachInterrupt(digitalPinToInterrupt(this->pinIn), Dali::inputISR, CHANGE);
-  timer1_attachInterrupt(Dali::timerISR);
   DALI_HIGH();
+#endif
 }
 
-daliError Dali::getError(void) {
+daliError DaliBus::getError(void) {
   return this->err;
 }
 
-void Dali::setError(daliError e) {
+void DaliBus::setError(daliError e) {
   this->err = e;
 }
 
-daliTime IRAM_ATTR Dali::getBitTime(void) {
+daliTime IRAM_ATTR DaliBus::getBitTime(void) {
   unsigned long diff;
   if (lastDaliHigh > lastDaliLow) {
     diff = lastDaliHigh - lastDaliLow;
@@ -151,7 +249,7 @@ daliTime IRAM_ATTR Dali::getBitTime(void) {
   return tiTooLong;
 }
 
-void IRAM_ATTR Dali::addBit(bool bit) {
+void IRAM_ATTR DaliBus::addBit(bool bit) {
   this->rcvdBits++;
   this->rcvdVal <<= 1;
   if (bit) {
@@ -159,29 +257,97 @@ void IRAM_ATTR Dali::addBit(bool bit) {
   }
 }
 
-void IRAM_ATTR Dali::daliIdle(void) {
+void IRAM_ATTR DaliBus::daliIdle(void) {
   if (this->state == stSecondHalf) {
     this->addBit(true);
     this->state = stFrameReady;
-    Dali::d->log("fR SH\n");
+    DaliBus::d->log("fR SH\n");
   } else if (this->state == stFirstHalf) {
     // We saw the line go high after a zero and assumed the first half of another zero, but
     // it turned out to be a stop
     this->state = stFrameReady;
-    Dali::d->log("fR FH\n");
+    DaliBus::d->log("fR FH\n");
   } else {    
     // Incorrect bit timing
     this->state = stIdle;
-    Dali::d->log("idle\n");
+    DaliBus::d->log("idle\n");
+  }
+  if (this->state == stFrameReady && this->rcvdBits > 8) {
+    this->longFrames++;
+  }
+  if (this->state == stFrameReady && this->rcvdBits == 16) {
+    // Another controller is sending forward frames, so it may have changed the DTRs
+    this->dtr[0] = this->dtr[1] = this->dtr[2] = -1;
+  }
+  if (this->state == stFrameReady && this->rcvdBits == 24) {
+    // Only input devices send 24-bit frames and nothing waits for them, so deal with them here
+    queueEvent();
+    this->state = stIdle;
+  }
+}
+
+// decodeEvent decodes a 24-bit frame from an input device into ev.  It returns false if
+// the frame isn't an event (i.e. it's a command from another controller).
+bool IRAM_ATTR DaliBus::decodeEvent(uint32 frame, daliEvent *ev) {
+  if (frame & 0x010000) {
+    // Commands always have this bit set, events never do
+    return false;
+  }
+  ev->device = -1;
+  ev->group = -1;
+  ev->instType = -1;
+  ev->instNum = -1;
+  ev->info = frame & 0x3ff;
+  byte hi = (frame >> 17) & 0x1f;
+  byte lo = (frame >> 10) & 0x1f;
+  bool loIsNum = (frame & 0x8000) != 0;
+  if (!(frame & 0x800000)) {
+    // 0AAAAAA0 xLLLLLEE EEEEEEEE
+    ev->device = (frame >> 17) & 0x3f;
+    if (loIsNum) {
+      ev->scheme = evSchemeDeviceInstance;
+      ev->instNum = lo;
+    } else {
+      ev->scheme = evSchemeDevice;
+      ev->instType = lo;
+    }
+  } else if (!(frame & 0x400000)) {
+    // 10GGGGG0 0TTTTTEE EEEEEEEE
+    ev->scheme = evSchemeDeviceGroup;
+    ev->group = hi;
+    ev->instType = lo;
+  } else if (!loIsNum) {
+    // 11TTTTT0 0NNNNNEE EEEEEEEE
+    ev->scheme = evSchemeInstance;
+    ev->instType = hi;
+    ev->instNum = lo;
+  } else {
+    // 11GGGGG0 1TTTTTEE EEEEEEEE
+    ev->scheme = evSchemeInstanceGroup;
+    ev->group = hi;
+    ev->instType = lo;
+  }
+  return true;
+}
+
+void IRAM_ATTR DaliBus::queueEvent(void) {
+  byte next = (this->evHead + 1) % DALI_EVENT_QUEUE_SIZE;
+  if (next == this->evTail) {
+    log("evq full\n");
+    return;
+  }
+  if (decodeEvent(this->rcvdVal, &this->events[this->evHead])) {
+    this->evHead = next;
   }
 }
 
-void IRAM_ATTR Dali::daliHigh(void) {
+void IRAM_ATTR DaliBus::daliHigh(void) {
   this->lastDaliHigh = micros();
+  // Edges are logged while sending too, so that sendFrameI2S can check for collisions
+  logEdge(this->lastDaliHigh, true, this->state);
   if (this->state == stSending) {
     return;
   }
-  logEdge(this->lastDaliHigh, true, this->state);
   daliTime bitTime = getBitTime();
   if (this->state == stStartBitH1) {
     if (bitTime == tiHalfBit) {
@@ -223,15 +389,16 @@ void IRAM_ATTR Dali::daliHigh(void) {
   }
 }
 
-void IRAM_ATTR Dali::daliLow(void) {
+void IRAM_ATTR DaliBus::daliLow(void) {
   this->lastDaliLow = micros();
+  logEdge(this->lastDaliLow, false, this->state);
   if (this->state == stSending) {
     return;
   }
   timer1_disable();
-  logEdge(this->lastDaliLow, false, this->state);
   daliTime bitTime = getBitTime();
-  if (this->state == stIdle) {
+  if (this->state == stIdle || this->state == stFrameReady) {
+    // A frame nobody claimed (e.g. from another controller) mustn't stop us seeing the next one
     this->state = stStartBitH1;
     this->rcvdBits = 0;
     this->rcvdVal = 0;
@@ -271,7 +438,7 @@ void IRAM_ATTR Dali::daliLow(void) {
 }
 
 // sendBit sends the bit in b, using Manchester encoding. It returns true if the bit was successfully sent, false if a collision was detected.
-bool Dali::sendBit(bool b) {
+bool DaliBus::sendBit(bool b) {
   unsigned long li;
   if (b) {
     DALI_LOW();
@@ -297,7 +464,7 @@ bool Dali::sendBit(bool b) {
   return true;
 }
 
-bool Dali::sendStopBit(void) {
+bool DaliBus::sendStopBit(void) {
   DALI_HIGH();
   unsigned long li = this->lastDaliLow;
   delaySinceLow(2400);
@@ -309,7 +476,7 @@ bool Dali::sendStopBit(void) {
 }
 
 // sendByte sends the given byte. It returns true if the byte was successfully sent, false if a collision was detected.
-bool Dali::sendByte(byte b) {
+bool DaliBus::sendByte(byte b) {
   for (int i = 0; i < 8; i++) {
     if (!sendBit((b&128)==128)) {
       return false;
@@ -319,7 +486,7 @@ bool Dali::sendByte(byte b) {
   return true;
 }
 
-void Dali::delaySinceLow(unsigned long wait) {
+void DaliBus::delaySinceLow(unsigned long wait) {
   unsigned long li = this->lastDaliLow;
   unsigned long start = micros();
   unsigned long now = start;
@@ -329,20 +496,108 @@ void Dali::delaySinceLow(unsigned long wait) {
   }
 }
 
+#ifdef DALI_TX_I2S
+// waitPriorityI2S is waitPriority for I2S.  Samples we write only go out once the DMA buffer
+// currently being output has finished, which can take up to DALI_I2S_BUF_US - enough to blur
+// the 1ms steps between priorities.  So we stop waiting up to two buffers early, wait for the
+// start of a buffer, then work out how many idle samples (*pad) to send before the frame so that
+// it starts exactly when the priority allows.
+bool DaliBus::waitPriorityI2S(daliPri priority, int *pad) {
+  unsigned long wait = 12000 + 1000 * priority;
+  unsigned long li = this->lastDaliLow;
+  delaySinceLow(wait - 2 * DALI_I2S_BUF_US);
+  unsigned long seen = i2sBufStarted;
+  unsigned long start = micros();
+  while (i2sBufStarted == seen && micros() - start < 2 * DALI_I2S_BUF_US) {
+    if (this->lastDaliLow != li) {
+      return false;
+    }
+  }
+  if (this->lastDaliLow != li) {
+    return false;
+  }
+  // Anything we write now goes out when the buffer that's just started has finished (see
+  // DALI_TX_I2S in dali.h)
+  unsigned long sinceLow = i2sBufStarted + DALI_I2S_BUF_US - li;
+  *pad = 0;
+  if (sinceLow < wait) {
+    *pad = (wait - sinceLow) * DALI_I2S_RATE / 1000000UL + 1;
+    if (*pad > 2 * DALI_I2S_BUF_SAMPLES) {
+      *pad = 2 * DALI_I2S_BUF_SAMPLES;
+    }
+  }
+  return true;
+}
+
+// sendFrameI2S hands pad idle samples, then the whole frame, to the I2S DMA, waits for it to go
+// out, then checks the edges seen on the bus against what we sent.  Idle samples after the frame
+// fill its last buffer.  It returns true if the frame was successfully sent, false if a collision
+// was detected.
+bool DaliBus::sendFrameI2S(uint32 frame, byte bits, int pad) {
+  uint64 pattern;
+  byte n = manchesterEncode(frame, bits, &pattern);
+  resetEdgeLog();
+  for (int i = 0; i < pad; i++) {
+    i2s_write_sample(DALI_I2S_IDLE);
+  }
+  for (byte i = 0; i < n; i++) {
+    uint32 sample = ((pattern >> (63 - i)) & 1) ? DALI_I2S_ACTIVE : DALI_I2S_IDLE;
+    for (byte j = 0; j < DALI_I2S_SAMPLES_PER_HB; j++) {
+      i2s_write_sample(sample);
+    }
+  }
+  int tail = (pad + n * DALI_I2S_SAMPLES_PER_HB) % DALI_I2S_BUF_SAMPLES;
+  for (int i = tail ? tail : DALI_I2S_BUF_SAMPLES; i < DALI_I2S_BUF_SAMPLES; i++) {
+    i2s_write_sample(DALI_I2S_IDLE);
+  }
+  unsigned long start = millis();
+  while (!i2s_is_empty() && millis() - start < 50) {
+    yield();
+  }
+  delaySinceLow(2400); // Stop bit
+  int bad = 0;
+  if (nEdges != 0 && !edgeDests[0]) {
+    bad = manchesterCompare(pattern, n, edgeTimes, nEdges, DALI_HB_NOM);
+  }
+  if (bad < 0) {
+    return true;
+  }
+  log("i2s mismatch %d/%d\n", bad, n);
+  if (bad < 2) {
+    setError(eSendStartBit);
+  } else if (bad < 18) {
+    setError(eSendAddr);
+  } else if (bad < n) {
+    setError(eSendMsg);
+  } else {
+    setError(eSendStop);
+  }
+  return false;
+}
+#endif
+
 // waitPriority waits until a message of the given priority can be sent.  It returns true if the wait completed without another 
-bool Dali::waitPriority(daliPri priority) {
+bool DaliBus::waitPriority(daliPri priority) {
   unsigned long li = this->lastDaliLow;
   delaySinceLow(12000 + 1000 * priority);
   return this->lastDaliLow==li;
 }
 
-// sendMessage sends a message with the given priority, address and message.
-// It returns true if the message was successfully sent, false if a collision was detected.
-bool Dali::sendForwardMessage(daliPri priority, daliAddr addr, daliMsg msg) {
+// sendForwardFrame sends the given number of bits (16 or 24) of frame with the given priority.
+// It returns true if the frame was successfully sent, false if a collision was detected.
+bool DaliBus::sendForwardFrame(daliPri priority, uint32 frame, byte bits) {
+#ifdef DALI_TX_I2S
+  int pad;
+  if (!waitPriorityI2S(priority, &pad)) {
+    setError(eWaitPri);
+    return false;
+  }
+#else
   if (!waitPriority(priority)) {
     setError(eWaitPri);
     return false;
   }
+#endif
   // We don't check the state before setting stSending.  Whatever was happening before,
   // we've just waited for a bunch of ms and nothing is happening now.  We're OK to just
   // overwrite a previous state. (This will also allow us to recover a few odd states.)
@@ -350,38 +605,50 @@ bool Dali::sendForwardMessage(daliPri priority, daliAddr addr, daliMsg msg) {
   // well, it should be a start bit.  In that case, we set state to stStartBitH1.  Only
   // if we uneventfully complete sending do we set state to stIdle.
   this->state = stSending;
-  if (!sendBit(true)) { // Start bit
+#ifdef DALI_TX_I2S
+  if (!sendFrameI2S(frame, bits, pad)) {
     this->state = stStartBitH1;
-    setError(eSendStartBit);
     return false;
   }
-  if (!sendByte((byte)(addr&0xFF))) {
+#else
+  if (!sendBit(true)) { // Start bit
     this->state = stStartBitH1;
-    setError(eSendAddr);
+    setError(eSendStartBit);
     return false;
   }
-  if (!sendByte((byte)(msg&0xFF))) {
-    this->state = stStartBitH1;
-    setError(eSendMsg);
-    return false;
+  for (int shift = bits - 8; shift >= 0; shift -= 8) {
+    if (!sendByte((byte)((frame >> shift) & 0xFF))) {
+      this->state = stStartBitH1;
+      setError(shift == bits - 8 ? eSendAddr : eSendMsg);
+      return false;
+    }
   }
   if (!sendStopBit()) {
     this->state = stStartBitH1;
     setError(eSendStop);
     return false;
   }
+#endif
   this->state = stIdle;
   return true;
 }
 
+// sendMessage sends a message with the given priority, address and message.
+// It returns true if the message was successfully sent, false if a collision was detected.
+bool DaliBus::sendForwardMessage(daliPri priority, daliAddr addr, daliMsg msg) {
+  return sendForwardFrame(priority, ((uint32)(addr & 0xFF) << 8) | (msg & 0xFF), 16);
+}
+
 // sendCommand sends a command with the given priority to the given address.
 // It repeats the message if the spec requires this.
 // It returns true if the message was successfully sent, false if a collision was detected.
-bool Dali::sendCommand(daliPri priority, daliAddr addr, daliMsg cmd) {
+bool DaliBus::sendCommand(daliPri priority, daliAddr addr, daliMsg cmd) {
   if (!sendForwardMessage(priority, addr, cmd)) {
     return false;
   }
-  if ((cmd >= 32 && cmd <= 129) || addr == addrInitialise || addr == addrRandomise) {
+  // Special commands (e.g. DTR0) carry data rather than an opcode, as does DAPC
+  bool isCmd = (addr & 1) && (addr < addrTerminate || addr == broadcast);
+  if ((isCmd && cmd >= 32 && cmd <= 129) || addr == addrInitialise || addr == addrRandomise) {
     // Message should be repeated
     if (!sendForwardMessage(priTxn, addr, cmd)) {
       return false;
@@ -390,7 +657,74 @@ bool Dali::sendCommand(daliPri priority, daliAddr addr, daliMsg cmd) {
   return true;
 }
 
-daliRcvStatus Dali::receiveFrame(byte bits, byte timeoutMs) {
+// sendTxn sends a forward frame as part of a transaction.  The first frame sent uses the
+// priority passed in, after which *priority is switched to priTxn for the rest.
+bool DaliBus::sendTxn(daliPri *priority, daliAddr addr, daliMsg msg) {
+  if (!sendForwardMessage(*priority, addr, msg)) {
+    return false;
+  }
+  *priority = priTxn;
+  return true;
+}
+
+// forgetDtrs makes setDtr send every DTR again.  setDtr only skips DTRs already set within
+// the same transaction: between transactions, gear may have been power cycled (which clears
+// their DTRs) or added to the bus, so they can't be relied on.
+void DaliBus::forgetDtrs(void) {
+  dtr[0] = dtr[1] = dtr[2] = -1;
+}
+
+// setDtr sets one of DTR0-2 as part of a transaction.  DTRs are set by broadcast, so if we
+// were the last to set it, every gear already holds the value and nothing needs sending.
+bool DaliBus::setDtr(daliPri *priority, byte n, byte value) {
+  static const daliAddr addrs[3] = { addrDTR0, addrDTR1, addrDTR2 };
+  if (dtr[n] == value) {
+    return true;
+  }
+  if (!sendTxn(priority, addrs[n], (daliMsg)value)) {
+    dtr[n] = -1;
+    return false;
+  }
+  dtr[n] = value;
+  return true;
+}
+
+bool DaliBus::sendDt8(daliPri *priority, daliAddr addr, daliDt8Cmd cmd) {
+  if (!sendTxn(priority, addrEnableDeviceType, (daliMsg)8)) {
+    return false;
+  }
+  return sendTxn(priority, addr | 1, (daliMsg)cmd);
+}
+
+// sendDeviceCommand sends an instance command to the input device with the given short address.
+// All the commands we send are configuration commands, which the spec requires to be repeated.
+bool DaliBus::sendDeviceCommand(daliPri priority, daliAddr addr, byte instance, daliDevCmd cmd) {
+  uint32 frame = ((uint32)(addr | 1) << 16) | ((uint32)instance << 8) | cmd;
+  if (!sendForwardFrame(priority, frame, 24)) {
+    return false;
+  }
+  return sendForwardFrame(priTxn, frame, 24);
+}
+
+// sendAddressing sends one of the special commands used for addressing, either to control gear
+// (using gearAddr) or to input devices (using devOp).
+bool DaliBus::sendAddressing(bool inputDevs, daliPri priority, daliAddr gearAddr, daliDevSpecial devOp, byte data) {
+  bool repeat = devOp == devInitialise || devOp == devRandomise;
+  for (int i = 0; i < (repeat ? 2 : 1); i++) {
+    bool ok;
+    if (inputDevs) {
+      ok = sendForwardFrame(i ? priTxn : priority, ((uint32)DALI_DEV_SPECIAL << 16) | ((uint32)devOp << 8) | data, 24);
+    } else {
+      ok = sendForwardMessage(i ? priTxn : priority, gearAddr, (daliMsg)data);
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+daliRcvStatus DaliBus::receiveFrame(byte bits, byte timeoutMs) {
   unsigned long wait = timeoutMs * 1000UL;
   unsigned long start = micros();
   resetEdgeLog();
@@ -409,46 +743,48 @@ daliRcvStatus Dali::receiveFrame(byte bits, byte timeoutMs) {
   return rNoFrame;
 }
 
-daliRcvStatus Dali::receiveBackwardFrame(void) {
+daliRcvStatus DaliBus::receiveBackwardFrame(void) {
   // 20ms == 10.5ms max settle time, plus 1 start bit + 8 data bits at 1ms/bit, rounded up
   return receiveFrame(8, 20);
 }
 
 // sendReset sends a factory reset to the given address.  It returns true if the message was successfully sent, false if a collision was detected.
-bool Dali::sendReset(daliAddr addr) {
+bool DaliBus::sendReset(daliAddr addr) {
   addr |= 1;
   return sendCommand(priConfig, addr, msgReset);
 }
 
-bool Dali::sendLampOff(daliAddr addr, bool fromUser) {
+bool DaliBus::sendLampOff(daliAddr addr, bool fromUser) {
   addr |= 1;
   return sendCommand(fromUser ? priUser : priAuto, addr, msgOff);
 }
 
-bool Dali::sendStepDownOff(daliAddr addr, bool fromUser) {
+bool DaliBus::sendStepDownOff(daliAddr addr, bool fromUser) {
   addr |= 1;
   return sendCommand(fromUser ? priUser : priAuto, addr, msgStepDownOff);
 }
 
-bool Dali::sendOnStepUp(daliAddr addr, bool fromUser) {
+bool DaliBus::sendOnStepUp(daliAddr addr, bool fromUser) {
   addr |= 1;
   return sendCommand(fromUser ? priUser : priAuto, addr, msgOnStepUp);
 }
 
-bool Dali::sendDapc(daliAddr addr, bool fromUser, byte level) {
+bool DaliBus::sendDapc(daliAddr addr, bool fromUser, byte level) {
   return sendCommand(fromUser ? priUser : priAuto, addr, (daliMsg)level);
 }
 
-bool Dali::sendSetPowerOnLevel(daliAddr addr, bool fromUser, byte level) {
+bool DaliBus::sendSetPowerOnLevel(daliAddr addr, bool fromUser, byte level) {
   // We have to set DTR0 first, then set POL to DTR0
+  daliPri pri = fromUser ? priUser : priAuto;
   addr |= 1;
-  if (!sendCommand(fromUser ? priUser : priAuto, addrDTR0, (daliMsg)level)) {
+  forgetDtrs();
+  if (!setDtr(&pri, 0, level)) {
     return false;
   }
-  return sendCommand(priTxn, addr, msgSetPowerOnLevel);
+  return sendCommand(pri, addr, msgSetPowerOnLevel);
 }
 
-int Dali::queryLevel(daliAddr addr, bool fromUser, daliMsg query) {
+int DaliBus::queryLevel(daliAddr addr, bool fromUser, daliMsg query) {
   addr |= 1;
   if (!sendCommand(fromUser ? priUser : priAuto, addr, query)) {
     return -1;
@@ -459,69 +795,502 @@ int Dali::queryLevel(daliAddr addr, bool fromUser, daliMsg query) {
   return (int)rcvdVal;
 }
 
-int Dali::queryMinLevel(daliAddr addr, bool fromUser) {
+// queryAny sends a yes/no query, which may be to a group or broadcast.  It returns 1 if
+// anything answered, 0 if nothing did, or <0 on failure.  Only one lamp can answer a short
+// address, so that needs a good frame.  Several lamps can answer a group or broadcast, and they
+// pick their own reply delays, so their answers can be garbled so badly the decoder never sees a
+// frame at all.  Gear only answer yes, so there, any activity counts as an answer - apart from
+// frames longer than a backward frame (events from input devices, or another controller), whether
+// they finished during the wait or were still going when it ended.
+int DaliBus::queryAny(daliPri priority, daliAddr addr, daliMsg query) {
+  if (!sendCommand(priority, addr | 1, query)) {
+    return -1;
+  }
+  byte longFrames = this->longFrames;
+  daliRcvStatus reply = receiveBackwardFrame();
+  if (reply == rGoodFrame) {
+    return 1;
+  }
+  if (!(addr & 0x80) || this->longFrames != longFrames || this->rcvdBits > 8) {
+    return 0;
+  }
+  // receiveFrame starts a fresh edge log, so any edges logged are from the reply window
+  return (reply == rBadFrame || nEdges > 0) ? 1 : 0;
+}
+
+// sweepQuery finds all lamps answering yes to a yes/no query (e.g. msgQueryLampFailure or
+// msgQueryControlGearFailure), setting their bits in affected.  It asks everyone at once first, so
+// if nothing answers, that's one frame for the whole bus.  Otherwise, it narrows things down using
+// groups (if queryGroups has been called for every lamp): a silent group clears all its lamps at
+// once.  Only lamps not cleared that way are asked individually.  Queries every gear answers, like
+// msgQueryStatus, can't be narrowed down like this.
+//
+// This isn't a bisection: it can only use the groups the lamps are already in, so with no groups
+// set up, any answer costs one query per lamp on top of the broadcast.  assignBisectionGroups sets
+// up groups which bring a single lamp answering down to one or two queries per short address bit.
+bool DaliBus::sweepQuery(daliMsg query, bool fromUser, uint64 *affected) {
+  daliPri pri = fromUser ? priUser : priQuery;
+  *affected = 0;
+  if (gearMask == 0) {
+    setError(eNoDevices);
+    return false;
+  }
+  int r = queryAny(pri, broadcast, query);
+  if (r <= 0) {
+    return r == 0;
+  }
+  uint64 candidates = gearMask;
+  if ((groupsKnown & gearMask) == gearMask) {
+    uint64 members[16];
+    for (byte g = 0; g < 16; g++) {
+      members[g] = groupMembers(g);
+    }
+    while (true) {
+      // Ask the group covering the most remaining candidates.  Groups covering all of them can't
+      // tell us anything: we already know at least one of them answers.
+      int best = -1;
+      int bestN = 0;
+      int nCandidates = __builtin_popcountll(candidates);
+      for (byte g = 0; g < 16; g++) {
+        int n = __builtin_popcountll(members[g] & candidates);
+        if (n > bestN && n < nCandidates) {
+          best = g;
+          bestN = n;
+        }
+      }
+      if (best < 0) {
+        break;
+      }
+      r = queryAny(pri, 0x80 | (best << 1), query);
+      if (r < 0) {
+        return false;
+      }
+      if (r == 0) {
+        candidates &= ~members[best];
+      }
+      members[best] = 0;
+    }
+  }
+  for (byte s = 0; s < 64; s++) {
+    if (!(candidates & ((uint64)1 << s))) {
+      continue;
+    }
+    r = queryAny(pri, s << 1, query);
+    if (r < 0) {
+      return false;
+    }
+    if (r > 0) {
+      *affected |= (uint64)1 << s;
+    }
+  }
+  return true;
+}
+
+// assignBisectionGroups puts every lamp into groups by short address, for sweepQuery to narrow
+// things down with.  For each bit k a short address needs, group firstGroup + 2k holds the lamps
+// with bit k set and group firstGroup + 2k + 1 those with it clear, so 64 lamps need 12 groups.
+// Anything else in those groups is removed from them, so only pass groups not otherwise in use.
+// It returns false on failure, including (with eTooFewGroups) if the groups would go past group
+// 15.  Setting the groups costs two frames per group plus two per lamp per bit, so it's only worth
+// doing once.
+bool DaliBus::assignBisectionGroups(byte firstGroup, bool fromUser) {
+  daliPri pri = fromUser ? priUser : priConfig;
+  if (gearMask == 0) {
+    setError(eNoDevices);
+    return false;
+  }
+  byte highest = 63 - __builtin_clzll(gearMask);
+  byte nBits = highest ? 32 - __builtin_clz(highest) : 0;
+  if (firstGroup + 2 * nBits > 16) {
+    setError(eTooFewGroups);
+    return false;
+  }
+  for (byte s = 0; s < 64; s++) {
+    if ((gearMask & ((uint64)1 << s)) && !(groupsKnown & ((uint64)1 << s))) {
+      if (queryGroups(s << 1, fromUser) < 0) {
+        return false;
+      }
+    }
+  }
+  uint16 mask = ((1 << (2 * nBits)) - 1) << firstGroup;
+  for (byte g = firstGroup; g < firstGroup + 2 * nBits; g++) {
+    if (!sendCommand(pri, broadcast, (daliMsg)(msgRemoveFromGroup + g))) {
+      return false;
+    }
+  }
+  for (byte s = 0; s < 64; s++) {
+    gearGroups[s] &= ~mask;
+    if (!(gearMask & ((uint64)1 << s))) {
+      continue;
+    }
+    for (byte k = 0; k < nBits; k++) {
+      byte g = firstGroup + 2 * k + (((s >> k) & 1) ? 0 : 1);
+      if (!sendCommand(pri, (s << 1) | 1, (daliMsg)(msgAddToGroup + g))) {
+        return false;
+      }
+      gearGroups[s] |= 1 << g;
+    }
+  }
+  return true;
+}
+
+int DaliBus::queryMinLevel(daliAddr addr, bool fromUser) {
   return queryLevel(addr, fromUser, msgQueryMinLevel);
 }
 
-int Dali::queryMaxLevel(daliAddr addr, bool fromUser) {
+int DaliBus::queryMaxLevel(daliAddr addr, bool fromUser) {
   return queryLevel(addr, fromUser, msgQueryMaxLevel);
 }
 
-int Dali::queryActualLevel(daliAddr addr, bool fromUser) {
+int DaliBus::queryActualLevel(daliAddr addr, bool fromUser) {
   return queryLevel(addr, fromUser, msgQueryActualLevel);
 }
 
-int Dali::queryPowerOnLevel(daliAddr addr, bool fromUser) {
+int DaliBus::queryPowerOnLevel(daliAddr addr, bool fromUser) {
   return queryLevel(addr, fromUser, msgQueryPowerOnLevel);
 }
 
-// Assigns new random short addresses to all available lamps
+long DaliBus::queryRandomAddr(daliAddr addr, daliPri priority) {
+  static const daliMsg parts[3] = { msgQueryRandomAddrH, msgQueryRandomAddrM, msgQueryRandomAddrL };
+  long ra = 0;
+  addr |= 1;
+  for (int i = 0; i < 3; i++) {
+    if (!sendForwardMessage(i ? priTxn : priority, addr, parts[i])) {
+      return -1;
+    }
+    if (receiveBackwardFrame() != rGoodFrame) {
+      setError(eNoRandomAddrAns);
+      return -2;
+    }
+    ra = (ra << 8) | (rcvdVal & 0xFF);
+  }
+  return ra;
+}
+
+// readMemoryLocs reads up to len bytes from the start of the given memory bank. DTR1 and DTR0
+// are only set once: the gear increments its DTR0 after each READ MEMORY LOCATION, so every
+// further byte costs a single query. Returns the number of bytes read, or <0 on failure.
+int DaliBus::readMemoryLocs(daliAddr addr, daliPri priority, byte bank, byte *buf, byte len) {
+  if (len == 0) {
+    return 0;
+  }
+  addr |= 1;
+  forgetDtrs();
+  if (!setDtr(&priority, 1, bank)) {
+    return -1;
+  }
+  if (!setDtr(&priority, 0, 0)) {
+    return -1;
+  }
+  // Location 0 holds the last accessible location in the bank, which tells us how much to read
+  if (!sendTxn(&priority, addr, msgReadMemoryLoc)) {
+    return -1;
+  }
+  dtr[0] = -1; // From here on, this lamp's DTR0 differs from everyone else's
+  if (receiveBackwardFrame() != rGoodFrame) {
+    setError(eNoMemoryAns);
+    return -2;
+  }
+  int n = (int)(rcvdVal & 0xFF) + 1;
+  if (n > len) {
+    n = len;
+  }
+  buf[0] = (byte)rcvdVal;
+  bool retried = false;
+  for (int i = 1; i < n; i++) {
+    if (!sendForwardMessage(priTxn, addr, msgReadMemoryLoc)) {
+      return -1;
+    }
+    daliRcvStatus reply = receiveBackwardFrame();
+    if (reply == rGoodFrame) {
+      buf[i] = (byte)rcvdVal;
+      retried = false;
+      continue;
+    }
+    // Unimplemented locations don't answer and a garbled answer might or might not have
+    // moved DTR0 on, so point DTR0 at where we want to be before carrying on.
+    if (reply == rBadFrame && !retried) {
+      retried = true;
+      i--;
+    } else {
+      buf[i] = 0xFF;
+      retried = false;
+    }
+    if (!sendForwardMessage(priTxn, addrDTR0, (daliMsg)(i + 1))) {
+      return -1;
+    }
+  }
+  return n;
+}
+
+daliBank0Entry* DaliBus::findBank0(uint32 randomAddr) {
+  for (byte i = 0; i < nBank0Cached; i++) {
+    if (bank0Cache[i].randomAddr == randomAddr) {
+      return &bank0Cache[i];
+    }
+  }
+  return NULL;
+}
+
+// readMemoryBank reads the given memory bank from a single lamp into buf, returning the number
+// of bytes read (at most len) or <0 on failure.  Bank 0 identifies the gear and can't change,
+// so it's cached by random address.  reAddressLamps tells us each lamp's random address, so
+// repeat reads don't need to send anything; otherwise, the lamp is asked for it first.
+int DaliBus::readMemoryBank(daliAddr addr, bool fromUser, byte bank, byte *buf, byte len) {
+  daliPri pri = fromUser ? priUser : priAuto;
+  if (bank != 0) {
+    return readMemoryLocs(addr, pri, bank, buf, len);
+  }
+  byte s = (addr >> 1) & 0x3f;
+  long ra;
+  if (randomKnown & ((uint64)1 << s)) {
+    ra = gearRandom[s];
+  } else {
+    ra = queryRandomAddr(addr, pri);
+    if (ra < 0) {
+      return (int)ra;
+    }
+    pri = priTxn;
+    if (ra != 0xFFFFFF) {
+      gearRandom[s] = (uint32)ra;
+      randomKnown |= (uint64)1 << s;
+    }
+  }
+  daliBank0Entry fresh;
+  daliBank0Entry *e = findBank0((uint32)ra);
+  if (!e) {
+    int n = readMemoryLocs(addr, pri, 0, fresh.data, DALI_BANK0_SIZE);
+    if (n < 0) {
+      return n;
+    }
+    fresh.randomAddr = (uint32)ra;
+    fresh.len = (byte)n;
+    if (ra == 0xFFFFFF) {
+      // Not randomised yet, so the random address doesn't identify this lamp
+      e = &fresh;
+    } else {
+      if (nBank0Cached < bank0CacheSize) {
+        e = &bank0Cache[nBank0Cached++];
+      } else {
+        e = &bank0Cache[ra % bank0CacheSize];
+      }
+      *e = fresh;
+    }
+  }
+  byte n = e->len < len ? e->len : len;
+  memcpy(buf, e->data, n);
+  return n;
+}
+
+// queryGroups returns a bitmask of the groups the lamp is in, or <0 on failure.  The result is
+// remembered, so that sendColours can address lamps by group.
+int DaliBus::queryGroups(daliAddr addr, bool fromUser) {
+  int lo = queryLevel(addr, fromUser, msgQueryGroup0_7);
+  if (lo < 0) {
+    return lo;
+  }
+  int hi = queryLevel(addr, fromUser, msgQueryGroup8_15);
+  if (hi < 0) {
+    return hi;
+  }
+  byte s = (addr >> 1) & 0x3f;
+  gearGroups[s] = (hi << 8) | lo;
+  groupsKnown |= (uint64)1 << s;
+  return gearGroups[s];
+}
+
+// groupMembers returns a bitmask of the short addresses of lamps in the group.  Only meaningful
+// if the groups of all lamps are known.
+uint64 DaliBus::groupMembers(byte group) {
+  uint64 members = 0;
+  for (byte s = 0; s < 64; s++) {
+    if ((gearMask & ((uint64)1 << s)) && (gearGroups[s] & (1 << group))) {
+      members |= (uint64)1 << s;
+    }
+  }
+  return members;
+}
+
+// findGroup returns a group containing exactly the given lamps, or -1 if there isn't one we
+// know of.
+int DaliBus::findGroup(uint64 lamps) {
+  if ((groupsKnown & gearMask) != gearMask) {
+    return -1;
+  }
+  for (int g = 0; g < 16; g++) {
+    if (groupMembers(g) == lamps) {
+      return g;
+    }
+  }
+  return -1;
+}
+
+// sendTempColour sets the temporary colour of the lamps at addr, as part of a transaction.
+bool DaliBus::sendTempColour(daliPri *priority, daliAddr addr, const daliColour *colour) {
+  switch (colour->type) {
+    case colTc:
+      return setDtr(priority, 0, colour->tc & 0xFF) && setDtr(priority, 1, colour->tc >> 8) &&
+        sendDt8(priority, addr, dt8SetTempTc);
+    case colXy:
+      return setDtr(priority, 0, colour->x & 0xFF) && setDtr(priority, 1, colour->x >> 8) &&
+        sendDt8(priority, addr, dt8SetTempX) &&
+        setDtr(priority, 0, colour->y & 0xFF) && setDtr(priority, 1, colour->y >> 8) &&
+        sendDt8(priority, addr, dt8SetTempY);
+    default:
+      return setDtr(priority, 0, colour->rgbwaf[0]) && setDtr(priority, 1, colour->rgbwaf[1]) &&
+        setDtr(priority, 2, colour->rgbwaf[2]) && sendDt8(priority, addr, dt8SetTempRGB) &&
+        setDtr(priority, 0, colour->rgbwaf[3]) && setDtr(priority, 1, colour->rgbwaf[4]) &&
+        setDtr(priority, 2, colour->rgbwaf[5]) && sendDt8(priority, addr, dt8SetTempWAF);
+  }
+}
+
+static bool sameColour(const daliColour *a, const daliColour *b) {
+  if (a->type != b->type) {
+    return false;
+  }
+  switch (a->type) {
+    case colTc:
+      return a->tc == b->tc;
+    case colXy:
+      return a->x == b->x && a->y == b->y;
+    default:
+      return !memcmp(a->rgbwaf, b->rgbwaf, sizeof(a->rgbwaf));
+  }
+}
+
+// sendColour sets the colour of the lamps at the given short, group or broadcast address.
+bool DaliBus::sendColour(daliAddr addr, bool fromUser, const daliColour *colour) {
+  daliPri pri = fromUser ? priUser : priAuto;
+  forgetDtrs();
+  return sendTempColour(&pri, addr, colour) && sendDt8(&pri, addr, dt8Activate);
+}
+
+// sendColours sets the colours of several lamps (given by short address) in one transaction.
+// Lamps wanting the same colour are addressed together, by broadcast or group if possible (see
+// queryGroups), and the new colours are activated together at the end.
+bool DaliBus::sendColours(const daliAddr *addrs, const daliColour *colours, byte n, bool fromUser) {
+  daliPri pri = fromUser ? priUser : priAuto;
+  forgetDtrs();
+  uint64 done = 0;
+  byte nTargets = 0;
+  daliAddr target = broadcast;
+  for (byte i = 0; i < n; i++) {
+    if (done & ((uint64)1 << ((addrs[i] >> 1) & 0x3f))) {
+      continue;
+    }
+    uint64 same = 0;
+    for (byte j = i; j < n; j++) {
+      if (sameColour(&colours[i], &colours[j])) {
+        same |= (uint64)1 << ((addrs[j] >> 1) & 0x3f);
+      }
+    }
+    done |= same;
+    int g;
+    if (same == gearMask) {
+      target = broadcast;
+    } else if ((g = findGroup(same)) >= 0) {
+      target = 0x80 | (g << 1);
+    } else {
+      for (byte s = 0; s < 64; s++) {
+        if (same & ((uint64)1 << s)) {
+          target = s << 1;
+          if (!sendTempColour(&pri, target, &colours[i])) {
+            return false;
+          }
+          nTargets++;
+        }
+      }
+      continue;
+    }
+    if (!sendTempColour(&pri, target, &colours[i])) {
+      return false;
+    }
+    nTargets++;
+  }
+  if (nTargets == 0) {
+    return true;
+  }
+  // Lamps whose temporary colour wasn't set ignore ACTIVATE, so one broadcast will do
+  return sendDt8(&pri, nTargets == 1 ? target : broadcast, dt8Activate);
+}
+
+// Assigns new random short addresses to all available lamps, at most maxAddrs of them.  The
+// addresses are written to addrs.
 // 
 // Returns number of lamps discovered
-daliAddr* Dali::reAddressLamps(byte *num) {
-  if (!sendCommand(priUser, addrInitialise, (daliMsg)0)) {
-    *num = 0;
-    return NULL;
+byte DaliBus::reAddressLamps(daliAddr *addrs, byte maxAddrs) {
+  return reAddress(false, addrs, maxAddrs);
+}
+
+// Assigns new random short addresses to all available input devices, at most maxAddrs of them,
+// then sets them to identify themselves in events by short address and instance number.  The
+// addresses are written to addrs.
+//
+// Returns number of input devices discovered
+byte DaliBus::reAddressInputDevices(daliAddr *addrs, byte maxAddrs) {
+  byte num = reAddress(true, addrs, maxAddrs);
+  if (num == 0) {
+    return 0;
+  }
+  if (!sendAddressing(true, priConfig, addrDTR0, devDTR0, evSchemeDeviceInstance)) {
+    return 0;
   }
-  if (!sendCommand(priUser, addrRandomise, (daliMsg)0)) {
-    *num = 0;
-    sendCommand(priUser, addrTerminate, (daliMsg)0); // No error checking - already in error
-    return NULL;
+  for (byte b = 0; b < num; b++) {
+    if (!sendDeviceCommand(priTxn, addrs[b], DALI_DEV_INSTANCE_ALL, devSetEventScheme) ||
+        !sendDeviceCommand(priTxn, addrs[b], DALI_DEV_INSTANCE_ALL, devEnableInstance)) {
+      return 0;
+    }
+  }
+  return num;
+}
+
+byte DaliBus::reAddress(bool inputDevs, daliAddr *addrs, byte maxAddrs) {
+  // Gear take 0 as "all gear", input devices take 0x7F as "all devices" (0xFF would only be
+  // those without a short address, which would then be given ones already in use)
+  if (!sendAddressing(inputDevs, priUser, addrInitialise, devInitialise, inputDevs ? 0x7F : 0)) {
+    return 0;
+  }
+  if (!sendAddressing(inputDevs, priUser, addrRandomise, devRandomise, 0)) {
+    sendAddressing(inputDevs, priUser, addrTerminate, devTerminate, 0); // No error checking - already in error
+    return 0;
+  }
+  if (!inputDevs) {
+    nBank0Cached = 0; // Cached bank 0 contents are keyed by the random addresses we just replaced
+    randomKnown = 0;
+    gearMask = 0;
+    groupsKnown = 0;
   }
   delay(100); // Randomised addresses are to be available 100ms after RANDOMISE
+  if (maxAddrs > 64) {
+    maxAddrs = 64; // 6 bits of short addr = max 63
+  }
   byte shortAddr;
   setError(eNoError);
-  // We loop through all 64 possible short addresses. For each, we call findDevice, which will find a
+  // We loop through the possible short addresses. For each, we call findDevice, which will find a
   // lamp (if there's a lamp with an unassigned short address) and assign it this short address
-  for (shortAddr = 0; shortAddr < 64; shortAddr++) { // 6 bits of short addr = max 63
-    if (!findDevice(0x000000, 0xFFFFFE, shortAddr)) {
+  for (shortAddr = 0; shortAddr < maxAddrs; shortAddr++) {
+    if (!findDevice(inputDevs, 0x000000, 0xFFFFFE, shortAddr)) {
       break;
     }
   }
   // Stop addressing mode
-  if (!sendCommand(priUser, addrTerminate, (daliMsg)0)) {
-    *num = 0;
-    return NULL;
+  if (!sendAddressing(inputDevs, priUser, addrTerminate, devTerminate, 0)) {
+    return 0;
   }
   if (shortAddr == 0) {
     // Didn't find any devices
     if (getError() == eNoError) {
       setError(eNoDevices);
     }
-    *num = 0;
-    return NULL;
-  }
-  daliAddr *ret = (daliAddr*)malloc(shortAddr * sizeof(daliAddr));
-  if (!ret)
-  {
-    *num = 0;
-    return NULL;
+    return 0;
   }
-  *num = shortAddr;
   for (byte b = 0; b < shortAddr; b++) {
-    ret[b] = b << 1;
+    addrs[b] = b << 1;
   }
-  return ret;
+  if (!inputDevs) {
+    gearMask = shortAddr == 64 ? ~(uint64)0 : ((uint64)1 << shortAddr) - 1;
+  }
+  return shortAddr;
 }
 
 // findDevice is a recursive function that binary searches for the 24-bit address of lamps
@@ -532,29 +1301,29 @@ daliAddr* Dali::reAddressLamps(byte *num) {
 // received there's a lamp with a long address <= the selected midpoint. If min==max, that
 // means we've found a long address. Otherwise, the top half of the currently-searched
 // space is searched.
-bool Dali::findDevice(uint32 min, uint32 max, byte shortAddr) {
-  log("findDevice(%06x, %06x, %02x)\n", min, max, shortAddr);
+bool DaliBus::findDevice(bool inputDevs, uint32 min, uint32 max, byte shortAddr) {
+  log("findDevice(%d, %06x, %06x, %02x)\n", inputDevs, min, max, shortAddr);
   if (min > max) {
     return false;
   }
   uint32 mid = (min + max) / 2;
-  if (!sendForwardMessage(priUser, addrSearchAddrH, (daliMsg)((mid >> 16) & 0xFF))) {
+  if (!sendAddressing(inputDevs, priUser, addrSearchAddrH, devSearchAddrH, (mid >> 16) & 0xFF)) {
     return false;
   }
-  if (!sendForwardMessage(priUser, addrSearchAddrM, (daliMsg)((mid >> 8) & 0xFF))) {
+  if (!sendAddressing(inputDevs, priUser, addrSearchAddrM, devSearchAddrM, (mid >> 8) & 0xFF)) {
     return false;
   }
-  if (!sendForwardMessage(priUser, addrSearchAddrL, (daliMsg)(mid & 0xFF))) {
+  if (!sendAddressing(inputDevs, priUser, addrSearchAddrL, devSearchAddrL, mid & 0xFF)) {
     return false;
   }
-  if (!sendForwardMessage(priUser, addrCompare, (daliMsg)0)) {
+  if (!sendAddressing(inputDevs, priUser, addrCompare, devCompare, 0)) {
     return false;
   }
   daliRcvStatus reply = receiveBackwardFrame();
   if (reply == rNoFrame) { 
     log("No\n");
     // No lamp in bottom half inc mid, search top half
-    return findDevice(mid+1, max, shortAddr);
+    return findDevice(inputDevs, mid+1, max, shortAddr);
   }
   if (reply == rBadFrame || rcvdVal != 0xFF) {
     // TODO: We should actually treat this as "two lamps in the top half", unless min==max
@@ -566,14 +1335,16 @@ bool Dali::findDevice(uint32 min, uint32 max, byte shortAddr) {
   log("Yes\n");
   if (min != max) {
     // Lamp in bottom half inc mid, search bottom half
-    return findDevice(min, mid, shortAddr);
+    return findDevice(inputDevs, min, mid, shortAddr);
   }
 
   log("Found %06X, setting %02X\n", min, shortAddr);
-  if (!sendForwardMessage(priUser, addrProgramShortAddr, (daliMsg)((shortAddr << 1) | 1))) {
+  // Gear take the short address in its addressing form (0AAAAAA1), input devices take it as is
+  byte progAddr = inputDevs ? shortAddr : (shortAddr << 1) | 1;
+  if (!sendAddressing(inputDevs, priUser, addrProgramShortAddr, devProgramShortAddr, progAddr)) {
     return false;
   }
-  if (!sendForwardMessage(priUser, addrVerifyShortAddr, (daliMsg)((shortAddr << 1) | 1))) {
+  if (!sendAddressing(inputDevs, priUser, addrVerifyShortAddr, devVerifyShortAddr, progAddr)) {
     return false;
   }
   reply = receiveBackwardFrame();
@@ -587,8 +1358,61 @@ bool Dali::findDevice(uint32 min, uint32 max, byte shortAddr) {
     setError(eBadVerifyAns);
     return false;
   }
-  if (!sendForwardMessage(priUser, addrWithdraw, (daliMsg)0)) {
+  if (!inputDevs) {
+    gearRandom[shortAddr] = min;
+    randomKnown |= (uint64)1 << shortAddr;
+  }
+  if (!sendAddressing(inputDevs, priUser, addrWithdraw, devWithdraw, 0)) {
     return false;
   }
   return true;
 }
+
+// handleEvent takes the oldest event received from an input device off the queue, acts on any
+// rules matching it and returns it in ev.  It returns false if there were no events queued.
+bool DaliBus::handleEvent(daliEvent *ev) {
+  if (this->evTail == this->evHead) {
+    return false;
+  }
+  *ev = this->events[this->evTail];
+  this->evTail = (this->evTail + 1) % DALI_EVENT_QUEUE_SIZE;
+  runEventRules(ev);
+  return true;
+}
+
+bool DaliBus::addEventRule(const daliEventRule *rule) {
+  if (nRules == DALI_MAX_EVENT_RULES) {
+    return false;
+  }
+  rules[nRules++] = *rule;
+  return true;
+}
+
+void DaliBus::clearEventRules(void) {
+  nRules = 0;
+}
+
+void DaliBus::runEventRules(const daliEvent *ev) {
+  for (byte i = 0; i < nRules; i++) {
+    const daliEventRule *r = &rules[i];
+    if ((r->device >= 0 && r->device != ev->device) ||
+        (r->instNum >= 0 && r->instNum != ev->instNum) ||
+        r->info != ev->info) {
+      continue;
+    }
+    bool ok;
+    switch (r->action) {
+      case actGoToScene:
+        ok = sendCommand(priUser, r->target | 1, (daliMsg)(msgGoToScene + (r->value & 0x0f)));
+        break;
+      case actDapc:
+        ok = sendDapc(r->target & ~1, true, r->value);
+        break;
+      default:
+        ok = sendLampOff(r->target, true);
+    }
+    if (!ok) {
+      log("rule %d failed: %d\n", i, getError());
+    }
+  }
+}
@@ -1,6 +1,25 @@
 #ifndef __DALI_H
 #define __DALI_H 1
 
+// EXPERIMENTAL, not yet tried on real hardware: uncomment to send frames using the I2S
+// peripheral, rather than by toggling the output pin.  Each frame is encoded up front and clocked
+// out by DMA, so timing isn't disturbed by WiFi interrupts.  I2S data always comes out on GPIO3
+// (RX), so DALI_O must be wired there; pinOut is ignored.  The I2S clocks also appear on GPIO15
+// and GPIO2 (the built-in LED on most boards).
+//
+// This relies on how the ESP8266 core's I2S driver (cores/esp8266/core_esp8266_i2s.cpp) works.
+// The DMA plays a ring of 8 buffers of 64 samples, round and round.  When a buffer finishes, the
+// driver zeroes it, appends it to a queue of free buffers and calls the i2s_set_callback()
+// function.  The queue holds at most 7: when it's full, the oldest is dropped, which is the
+// buffer the DMA has just started.  i2s_write_sample() fills a buffer from the front of the queue
+// until it's full, then takes the next.  So once everything written has been played (which
+// sendFrameI2S waits for), the buffer filled next is the one after the buffer being played:
+// samples written go out as soon as the current buffer has finished (up to 3.3ms).  The priority
+// wait syncs to the start of a buffer and pads with idle samples to keep the 1ms priority steps,
+// and every frame is padded out to whole buffers, so the next one never starts in a buffer that
+// has already been played.
+// #define DALI_TX_I2S
+
 typedef byte daliAddr;
 
 typedef enum {
@@ -92,6 +111,134 @@ typedef enum {
   msgAppExtCmdBase = 0xe0,
 } daliMsg;
 
+// Application extended commands for colour control gear (device type 8, IEC 62386-209).  Each
+// has to be immediately preceded by ENABLE DEVICE TYPE 8.
+typedef enum {
+  dt8SetTempX = 0xe0,        // DTR1:DTR0
+  dt8SetTempY,               // DTR1:DTR0
+  dt8Activate,
+  dt8XStepUp,
+  dt8XStepDown,
+  dt8YStepUp,
+  dt8YStepDown,
+  dt8SetTempTc,              // DTR1:DTR0, in mirek
+  dt8TcStepCooler,
+  dt8TcStepWarmer,
+  dt8SetTempPrimaryN,        // DTR2 = N, DTR1:DTR0
+  dt8SetTempRGB,             // DTR0 = R, DTR1 = G, DTR2 = B
+  dt8SetTempWAF,             // DTR0 = W, DTR1 = A, DTR2 = F
+  dt8SetTempRGBWAFControl,   // DTR0
+  dt8CopyReportToTemp,
+} daliDt8Cmd;
+
+typedef enum {
+  colTc,
+  colXy,
+  colRgbwaf,
+} daliColourType;
+
+typedef struct {
+  daliColourType type;
+  uint16 tc;          // colTc: colour temperature in mirek
+  uint16 x, y;        // colXy: CIE 1931 coordinates, 0-65535 meaning 0-1
+  byte rgbwaf[6];     // colRgbwaf: red, green, blue, white, amber, free colour levels
+} daliColour;
+
+// Special commands for DALI-2 input devices (IEC 62386-103).  These are sent as 24-bit frames:
+// 0xC1, then the opcode below, then a data byte.
+typedef enum {
+  devTerminate = 0x00,
+  devInitialise,
+  devRandomise,
+  devCompare,
+  devWithdraw,
+  devSearchAddrH,
+  devSearchAddrM,
+  devSearchAddrL,
+  devProgramShortAddr,
+  devVerifyShortAddr,
+  devQueryShortAddr,
+
+  devDTR0 = 0x30,
+  devDTR1,
+  devDTR2,
+} daliDevSpecial;
+
+// Instance commands for DALI-2 input devices, sent as <short addr> <instance> <opcode>.
+typedef enum {
+  devSetEventPriority = 0x61,
+  devEnableInstance,
+  devDisableInstance,
+  devSetPrimaryInstanceGroup,
+  devSetInstanceGroup1,
+  devSetInstanceGroup2,
+  devSetEventScheme,
+  devSetEventFilter,
+} daliDevCmd;
+
+#define DALI_DEV_SPECIAL 0xC1
+#define DALI_DEV_INSTANCE_ALL 0xFF // Instance byte addressing all instances of a device
+
+// How an input device identifies itself in the events it sends
+typedef enum {
+  evSchemeInstance,       // Instance type and number
+  evSchemeDevice,         // Short address and instance type
+  evSchemeDeviceInstance, // Short address and instance number
+  evSchemeDeviceGroup,    // Device group and instance type
+  evSchemeInstanceGroup,  // Instance group and instance type
+} daliEventScheme;
+
+typedef enum {
+  instGeneric = 0,
+  instPushButton,
+  instAbsoluteInput,
+  instOccupancySensor,
+  instLightSensor,
+} daliInstanceType;
+
+// Event information sent by push buttons (IEC 62386-301)
+typedef enum {
+  btnReleased = 0x00,
+  btnPressed = 0x01,
+  btnShortPress = 0x02,
+  btnDoublePress = 0x05,
+  btnLongPressStart = 0x09,
+  btnLongPressRepeat = 0x0b,
+  btnLongPressStop = 0x0c,
+  btnFree = 0x0e,
+  btnStuck = 0x0f,
+} daliButtonEvent;
+
+// A decoded event frame.  Which of the fields are set depends on the scheme; the rest are -1.
+typedef struct {
+  daliEventScheme scheme;
+  signed char device;   // Short address, 0-63
+  signed char group;    // Device group or instance group, 0-31
+  signed char instType; // daliInstanceType
+  signed char instNum;  // Instance number, 0-31
+  uint16 info;          // 10 bits, meaning depends on instance type (e.g. daliButtonEvent)
+} daliEvent;
+
+#define DALI_EVENT_QUEUE_SIZE 16 // Must be a power of two
+#define DALI_MAX_EVENT_RULES 16
+
+typedef enum {
+  actGoToScene,
+  actDapc,
+  actOff,
+} daliRuleAction;
+
+// A rule sending a command to lamps when a matching event is received, without waiting for
+// anything off-board to react.
+typedef struct {
+  signed char device;    // Short address to match, or -1 to match any
+  signed char instNum;   // Instance number to match, or -1 to match any
+  uint16 info;           // Event information to match
+  daliAddr target;       // Short, group or broadcast address of lamps to act on
+  daliRuleAction action;
+  byte value;            // Scene for actGoToScene, level for actDapc
+} daliEventRule;
+
 typedef enum {
   stIdle,
   stSending,
@@ -121,17 +268,45 @@ typedef enum {
   eBadBackFrame,
   eNoVerifyAns,
   eBadVerifyAns,
+  eNoMemoryAns,
+  eTooFewGroups,
+  eNoRandomAddrAns,
 } daliError;
 
+// Offsets within memory bank 0, which identifies the gear.  Bank 0 can't be written, so
+// its content is cached once read.
+typedef enum {
+  bank0LastLoc = 0x00,
+  bank0LastBank = 0x02,
+  bank0GTIN = 0x03,            // 6 bytes, MSB first
+  bank0FirmwareVersion = 0x09, // 2 bytes, major then minor
+  bank0IdentNo = 0x0b,         // 8 bytes, MSB first
+  bank0HardwareVersion = 0x13, // 2 bytes, major then minor
+  bank0Version101 = 0x15,
+  bank0Version102,
+  bank0Version103,
+  bank0NumDevUnits,
+  bank0NumGearUnits,
+  bank0UnitIndex,
+} daliBank0Loc;
+
+#define DALI_BANK0_SIZE 32
+
+typedef struct {
+  uint32 randomAddr;
+  byte len;
+  byte data[DALI_BANK0_SIZE];
+} daliBank0Entry;
+
 typedef enum {
   rNoFrame,
   rBadFrame,
   rGoodFrame,
 } daliRcvStatus;
 
-class Dali {
+// DaliBus does all the work, but doesn't own any buffers: use Dali, below, which does.
+class DaliBus {
 public:
-  Dali(int pinIn, int pinOut);
   void init();
   void log(const char* fmt, ...);
   bool sendReset(daliAddr addr);
@@ -144,15 +319,30 @@ public:
   int queryMaxLevel(daliAddr addr, bool fromUser);
   int queryActualLevel(daliAddr addr, bool fromUser);
   int queryPowerOnLevel(daliAddr addr, bool fromUser);
+  int readMemoryBank(daliAddr addr, bool fromUser, byte bank, byte *buf, byte len);
+  int queryGroups(daliAddr addr, bool fromUser);
+  bool sweepQuery(daliMsg query, bool fromUser, uint64 *affected);
+  bool assignBisectionGroups(byte firstGroup, bool fromUser);
+  bool sendColour(daliAddr addr, bool fromUser, const daliColour *colour);
+  bool sendColours(const daliAddr *addrs, const daliColour *colours, byte n, bool fromUser);
   daliError getError(void);
-  daliAddr *reAddressLamps(byte *num);
-  const char* getLogBuf(void);
+  byte reAddressLamps(daliAddr *addrs, byte maxAddrs);
+  byte reAddressInputDevices(daliAddr *addrs, byte maxAddrs);
+  bool handleEvent(daliEvent *ev);
+  bool addEventRule(const daliEventRule *rule);
+  void clearEventRules(void);
+  uint32 getLog(uint32 cursor, const char **chunk1, size_t *len1, const char **chunk2, size_t *len2);
+  bool logOverwritten(uint32 cursor);
 
   static const daliAddr broadcast;
+protected:
+  DaliBus(int pinIn, int pinOut, char *logBuf, uint32 logSize,
+          unsigned long *edgeTimes, bool *edgeDests, daliState *edgeStates, int edgeSlots,
+          daliBank0Entry *bank0Cache, byte bank0CacheSize);
 private:
   static void inputISR(void);
   static void timerISR(void);
-  static Dali *d;
+  static DaliBus *d;
 
   static const daliAddr addrTerminate;
   static const daliAddr addrDTR0;
@@ -184,25 +374,65 @@ private:
   bool sendBit(bool b);
   bool sendStopBit(void);
   bool sendByte(byte b);
+  bool waitPriorityI2S(daliPri priority, int *pad);
+  bool sendFrameI2S(uint32 frame, byte bits, int pad);
   void delaySinceLow(unsigned long wait);
   bool waitPriority(daliPri priority);
+  bool sendForwardFrame(daliPri priority, uint32 frame, byte bits);
   bool sendForwardMessage(daliPri priority, daliAddr addr, daliMsg data);
   bool sendCommand(daliPri priority, daliAddr addr, daliMsg cmd);
+  bool sendTxn(daliPri *priority, daliAddr addr, daliMsg msg);
+  void forgetDtrs(void);
+  bool setDtr(daliPri *priority, byte dtr, byte value);
+  bool sendDt8(daliPri *priority, daliAddr addr, daliDt8Cmd cmd);
+  bool sendTempColour(daliPri *priority, daliAddr addr, const daliColour *colour);
+  int findGroup(uint64 lamps);
+  bool sendDeviceCommand(daliPri priority, daliAddr addr, byte instance, daliDevCmd cmd);
+  bool sendAddressing(bool inputDevs, daliPri priority, daliAddr gearAddr, daliDevSpecial devOp, byte data);
+  static bool decodeEvent(uint32 frame, daliEvent *ev);
+  void queueEvent(void);
+  void runEventRules(const daliEvent *ev);
   daliRcvStatus receiveFrame(byte bits, byte timeoutMs);
   daliRcvStatus receiveBackwardFrame(void);
-  bool findDevice(uint32 min, uint32 max, byte shortAddr);
+  byte reAddress(bool inputDevs, daliAddr *addrs, byte maxAddrs);
+  bool findDevice(bool inputDevs, uint32 min, uint32 max, byte shortAddr);
   int queryLevel(daliAddr addr, bool fromUser, daliMsg query);
+  int queryAny(daliPri priority, daliAddr addr, daliMsg query);
+  uint64 groupMembers(byte group);
+  long queryRandomAddr(daliAddr addr, daliPri priority);
+  int readMemoryLocs(daliAddr addr, daliPri priority, byte bank, byte *buf, byte len);
+  daliBank0Entry* findBank0(uint32 randomAddr);
 
   char* logBuf;
-  char* logPtr;
+  uint32 logSize;
+  volatile uint32 logHead;
   void resetEdgeLog(void);
   void logEdge(unsigned long t, bool v, daliState s);
   void dumpEdgeLog(const char *tag);
   unsigned long* edgeTimes;
   bool* edgeDests;
   daliState* edgeStates;
+  int edgeSlots;
   int nEdges;
 
+  daliBank0Entry* bank0Cache;
+  byte bank0CacheSize;
+  byte nBank0Cached;
+
+  volatile short dtr[3]; // What we last set DTR0-2 to, or -1 if we don't know
+  uint64 gearMask;        // Bit n is set if a lamp has short address n
+  uint64 groupsKnown;     // Bit n is set if gearGroups[n] is known
+  uint16 gearGroups[64];  // Bit g is set if the lamp is in group g
+  uint64 randomKnown;     // Bit n is set if gearRandom[n] is known
+  uint32 gearRandom[64];  // The lamp's random address, as found by reAddressLamps
+
+  daliEvent events[DALI_EVENT_QUEUE_SIZE];
+  volatile byte evHead;
+  volatile byte evTail;
+  volatile byte longFrames; // Counts frames seen longer than a backward frame
+  daliEventRule rules[DALI_MAX_EVENT_RULES];
+  byte nRules;
+
   byte lastLevel;
   int pinIn;
   int pinOut;
@@ -214,4 +444,27 @@ private:
   volatile daliState state;
 };
 
+// Dali is a DaliBus with all its buffers sized at compile time, so nothing is allocated on the
+// heap.  Declare it globally (e.g. Dali<16> dali(PIN_I, PIN_O);) to put them in static storage.
+//   MaxGear   - the number of lamps whose bank 0 contents can be cached.  Everything else kept
+//               per lamp is indexed by short address, so always covers all 64.
+//   LogBytes  - the size of the log; must be a power of two, so log cursors wrap consistently
+//   EdgeSlots - the number of bus edges which can be logged for debugging and collision checks
+template <byte MaxGear = 64, uint32 LogBytes = 4096, int EdgeSlots = 100>
+class Dali : public DaliBus {
+  static_assert(MaxGear > 0 && MaxGear <= 64, "DALI allows at most 64 lamps");
+  static_assert(LogBytes > 100 && (LogBytes & (LogBytes - 1)) == 0, "LogBytes must be a power of two");
+  static_assert(EdgeSlots >= 52, "EdgeSlots must hold at least a 24-bit frame");
+public:
+  Dali(int pinIn, int pinOut)
+    : DaliBus(pinIn, pinOut, logStore, LogBytes, edgeTimeStore, edgeDestStore, edgeStateStore, EdgeSlots,
+              bank0Store, MaxGear) {}
+private:
+  char logStore[LogBytes];
+  unsigned long edgeTimeStore[EdgeSlots];
+  bool edgeDestStore[EdgeSlots];
+  daliState edgeStateStore[EdgeSlots];
+  daliBank0Entry bank0Store[MaxGear];
+};
+
 #endif
@@ -0,0 +1,66 @@
+#include "manchester.h"
+
+// The half-bits for each nibble, most significant bit first.  A one is low then high, a zero
+// is high then low.
+static const uint8_t manchesterNibble[16] = {
+  0x55, 0x56, 0x59, 0x5a, 0x65, 0x66, 0x69, 0x6a,
+  0x95, 0x96, 0x99, 0x9a, 0xa5, 0xa6, 0xa9, 0xaa,
+};
+
+// manchesterEncode encodes the start bit and the given number of bits (a multiple of 4, at most
+// MANCHESTER_MAX_BITS) of frame into pattern. It returns the number of half-bits in the pattern.
+uint8_t manchesterEncode(uint32_t frame, uint8_t bits, uint64_t *pattern) {
+  uint64_t p = 0x2; // Start bit, a one
+  for (int shift = bits - 4; shift >= 0; shift -= 4) {
+    p = (p << 8) | manchesterNibble[(frame >> shift) & 0xf];
+  }
+  uint8_t n = 2 + 2 * bits;
+  *pattern = p << (64 - n);
+  return n;
+}
+
+// manchesterCompare checks the edges seen on the bus while a pattern was sent against the
+// pattern.  edges holds the times (in us) of alternating falling and rising edges, starting with
+// the falling edge at the start of the start bit.  It returns the index of the first half-bit
+// that doesn't match (halfBits if there was activity after the pattern), or -1 if all match.
+int manchesterCompare(uint64_t pattern, uint8_t halfBits, const unsigned long *edges, int nEdges, unsigned long halfBitUs) {
+  // The receiving hardware stretches and shrinks half-bits, so allow nearly a third either way
+  unsigned long slack = halfBitUs * 3 / 10;
+  bool low = true;
+  int i = 0;
+  for (int e = 0; e < nEdges; e++) {
+    unsigned long n;
+    bool pastEnd = false;
+    if (e + 1 < nEdges) {
+      unsigned long dt = edges[e + 1] - edges[e];
+      n = (dt + halfBitUs / 2) / halfBitUs;
+      unsigned long nominal = n * halfBitUs;
+      if (!low && i + n >= halfBits) {
+        // The bus went idle for the rest of the pattern, then something else happened
+        pastEnd = true;
+        n = halfBits - i;
+      } else if (n == 0 || n > 2 || (dt > nominal ? dt - nominal : nominal - dt) > slack) {
+        return i;
+      }
+    } else {
+      // After the last edge, the bus should stay idle to the end of the pattern
+      if (low) {
+        return i;
+      }
+      n = halfBits - i;
+    }
+    for (; n > 0; n--, i++) {
+      if (i >= halfBits) {
+        return halfBits;
+      }
+      if (((pattern >> (63 - i)) & 1) != (low ? 1u : 0u)) {
+        return i;
+      }
+    }
+    if (pastEnd) {
+      return halfBits;
+    }
+    low = !low;
+  }
+  return i < halfBits ? i : -1;
+}
@@ -0,0 +1,16 @@
+#ifndef __MANCHESTER_H
+#define __MANCHESTER_H 1
+
+#include <stdint.h>
+
+// Encoding of forward frames into half-bit patterns, for transmitting with a peripheral rather
+// than bit-banging.  Patterns are left-aligned in a uint64_t, one bit per half-bit, with 1 meaning
+// the bus is low (active) and 0 meaning it's high (idle).  The stop bit is the idle bus after the
+// pattern, so it isn't included.  Nothing here depends on Arduino, so it can be built on a host.
+
+#define MANCHESTER_MAX_BITS 24
+
+uint8_t manchesterEncode(uint32_t frame, uint8_t bits, uint64_t *pattern);
+int manchesterCompare(uint64_t pattern, uint8_t halfBits, const unsigned long *edges, int nEdges, unsigned long halfBitUs);
+
+#endif
@@ -0,0 +1,393 @@
+// See fake_bus.h.  Nothing here allocates, so that test_alloc can count the library's
+// allocations alone.
+
+#include "fake_bus.h"
+
+#define HB 416         // Nominal half-bit, us
+#define REPLY_DELAY 7000 // From the end of a forward frame to the start of the backward frame
+#define MAX_EDGES 64
+#define MAX_SCHEDULED 512
+#define BANK0_LAST_LOC 0x1a
+
+typedef struct {
+  uint32 randomAddr;
+  byte shortAddr;
+  bool initialised;
+  bool withdrawn;
+  bool failed;
+  uint16 groups;
+  byte dtr[3];
+  byte level;
+} fakeGear;
+
+typedef struct {
+  unsigned long t;
+  int drive; // +1 when a lamp starts pulling the bus low, -1 when it lets go
+} fakeEdge;
+
+static unsigned long now;
+static bool inIsr;
+
+static int pinOut = -1;
+static void (*inputIsr)(void);
+static void (*timerIsr)(void);
+static bool timerArmed;
+static unsigned long timerAt;
+
+static bool ctrlLow;
+static int gearLow;
+static bool busLow;
+
+// The forward frame currently being sent
+static bool frameActive;
+static unsigned long frameEdges[MAX_EDGES];
+static bool frameLevels[MAX_EDGES];
+static int nFrameEdges;
+static unsigned long frames;
+
+static fakeEdge scheduled[MAX_SCHEDULED];
+static int nScheduled;
+
+static fakeGear gear[FAKE_MAX_GEAR];
+static int nGear;
+static uint32 searchAddr;
+
+static bool eventPending;
+static uint16 eventAfter;
+static uint32 eventFrame;
+
+int fakeGearAdd(uint32 randomAddr) {
+  fakeGear *g = &gear[nGear];
+  memset(g, 0, sizeof(*g));
+  g->randomAddr = randomAddr;
+  g->shortAddr = 0xFF;
+  return nGear++;
+}
+
+void fakeGearSetGroups(int i, uint16 groups) {
+  gear[i].groups = groups;
+}
+
+void fakeGearSetFailed(int i, bool failed) {
+  gear[i].failed = failed;
+}
+
+byte fakeGearLevel(int i) {
+  return gear[i].level;
+}
+
+uint16 fakeGearGroups(int i) {
+  return gear[i].groups;
+}
+
+byte fakeGearShortAddr(int i) {
+  return gear[i].shortAddr;
+}
+
+byte fakeGearBank0(int i, byte loc) {
+  if (loc == 0) {
+    return BANK0_LAST_LOC;
+  }
+  return (byte)(gear[i].randomAddr >> (loc % 3 * 8)) ^ loc;
+}
+
+unsigned long fakeBusFrames(void) {
+  return frames;
+}
+
+static void updateBus(void) {
+  bool low = ctrlLow || gearLow > 0;
+  if (low == busLow) {
+    return;
+  }
+  busLow = low;
+  if (inputIsr) {
+    inIsr = true;
+    inputIsr();
+    inIsr = false;
+  }
+}
+
+static void schedule(unsigned long t, int drive) {
+  if (nScheduled == MAX_SCHEDULED) {
+    printf("fake_bus: too many scheduled edges\n");
+    abort();
+  }
+  scheduled[nScheduled].t = t;
+  scheduled[nScheduled].drive = drive;
+  nScheduled++;
+}
+
+// sendFrame has a device send a frame of the given number of bits starting at t
+static void sendFrame(unsigned long t, uint32 val, int bits) {
+  bool low = false;
+  int halfBits = 2 + 2 * bits;
+  // Start bit, then the data bits, each a low and a high half for a one and the reverse for a zero
+  for (int i = 0; i < halfBits; i++) {
+    bool one = i < 2 ? true : (val >> (bits - 1 - (i - 2) / 2)) & 1;
+    bool l = (i & 1) ? !one : one;
+    if (l != low) {
+      schedule(t + i * HB, l ? 1 : -1);
+      low = l;
+    }
+  }
+  if (low) {
+    schedule(t + halfBits * HB, -1);
+  }
+}
+
+void fakeBusSend(unsigned long delayUs, uint32 frame, int bits) {
+  sendFrame(now + delayUs, frame, bits);
+}
+
+void fakeBusEventAfter(uint16 frame, uint32 event) {
+  eventAfter = frame;
+  eventFrame = event;
+  eventPending = true;
+}
+
+static bool addressed(const fakeGear *g, byte addr) {
+  if (addr >= 0xFE) {
+    return true;
+  }
+  if (addr & 0x80) {
+    return (g->groups >> ((addr >> 1) & 0x0f)) & 1;
+  }
+  return g->shortAddr == ((addr >> 1) & 0x3f);
+}
+
+// gearCommand has every lamp act on a 16-bit forward frame, answering at replyAt if it should
+static void gearCommand(byte addr, byte cmd, unsigned long replyAt) {
+  for (int i = 0; i < nGear; i++) {
+    fakeGear *g = &gear[i];
+    int ans = -1;
+    if (addr >= 0xa1 && addr <= 0xcb && (addr & 1)) {
+      // Special commands
+      switch (addr) {
+        case 0xa1: g->initialised = false; g->withdrawn = false; break;
+        case 0xa3: g->dtr[0] = cmd; break;
+        case 0xa5:
+          if (cmd == 0 || (cmd == 0xFF && g->shortAddr == 0xFF) || cmd == ((g->shortAddr << 1) | 1)) {
+            g->initialised = true;
+            g->withdrawn = false;
+          }
+          break;
+        case 0xa9:
+          if (g->initialised && !g->withdrawn && g->randomAddr <= searchAddr) {
+            ans = 0xFF;
+          }
+          break;
+        case 0xab:
+          if (g->initialised && g->randomAddr == searchAddr) {
+            g->withdrawn = true;
+          }
+          break;
+        case 0xb1: searchAddr = (searchAddr & 0x00FFFF) | ((uint32)cmd << 16); break;
+        case 0xb3: searchAddr = (searchAddr & 0xFF00FF) | ((uint32)cmd << 8); break;
+        case 0xb5: searchAddr = (searchAddr & 0xFFFF00) | cmd; break;
+        case 0xb7:
+          if (g->initialised && g->randomAddr == searchAddr) {
+            g->shortAddr = cmd == 0xFF ? 0xFF : (cmd >> 1) & 0x3f;
+          }
+          break;
+        case 0xb9:
+          if (g->initialised && cmd == ((g->shortAddr << 1) | 1)) {
+            ans = 0xFF;
+          }
+          break;
+        case 0xc3: g->dtr[1] = cmd; break;
+        case 0xc5: g->dtr[2] = cmd; break;
+      }
+    } else if (addressed(g, addr)) {
+      if (!(addr & 1)) {
+        g->level = cmd;
+      } else if (cmd >= 0x60 && cmd <= 0x6f) {
+        g->groups |= 1 << (cmd & 0x0f);
+      } else if (cmd >= 0x70 && cmd <= 0x7f) {
+        g->groups &= ~(1 << (cmd & 0x0f));
+      } else if (cmd == 0x92) {
+        ans = g->failed ? 0xFF : -1;
+      } else if (cmd == 0xa0) {
+        ans = g->level;
+      } else if (cmd == 0xc0) {
+        ans = g->groups & 0xFF;
+      } else if (cmd == 0xc1) {
+        ans = g->groups >> 8;
+      } else if (cmd >= 0xc2 && cmd <= 0xc4) {
+        ans = (g->randomAddr >> ((0xc4 - cmd) * 8)) & 0xFF;
+      } else if (cmd == 0xc5) {
+        if (g->dtr[1] == 0 && g->dtr[0] <= BANK0_LAST_LOC) {
+          ans = fakeGearBank0(i, g->dtr[0]);
+        }
+        if (g->dtr[0] != 0xFF) {
+          g->dtr[0]++;
+        }
+      }
+    }
+    if (ans >= 0) {
+      sendFrame(replyAt, (byte)ans, 8);
+    }
+  }
+}
+
+static bool frameLevelAt(unsigned long t) {
+  bool low = false;
+  for (int i = 0; i < nFrameEdges && frameEdges[i] <= t; i++) {
+    low = frameLevels[i];
+  }
+  return low;
+}
+
+// decodeFrame decodes the forward frame the controller just finished sending by sampling the
+// middle of the first half of each bit, then has the gear act on it.
+static void decodeFrame(void) {
+  frameActive = false;
+  unsigned long t0 = frameEdges[0];
+  unsigned long tLast = frameEdges[nFrameEdges - 1];
+  int halfBits = (tLast - t0 + HB / 2) / HB;
+  if (halfBits & 1) {
+    halfBits++; // A frame ending in a one doesn't have an edge at the end
+  }
+  int bits = halfBits / 2 - 1;
+  if (bits != 16 && bits != 24) {
+    printf("fake_bus: can't decode a %d-bit frame\n", bits);
+    return;
+  }
+  uint32 frame = 0;
+  for (int b = 1; b <= bits; b++) {
+    frame = (frame << 1) | frameLevelAt(t0 + 2 * b * HB + HB / 2);
+  }
+  frames++;
+  if (bits == 16 && eventPending && frame == eventAfter) {
+    eventPending = false;
+    sendFrame(tLast + REPLY_DELAY, eventFrame, 24);
+  }
+  if (bits == 16) {
+    gearCommand(frame >> 8, frame & 0xFF, tLast + REPLY_DELAY);
+  }
+}
+
+// advance moves the clock on by us, delivering any interrupts due on the way
+static void advance(unsigned long us) {
+  unsigned long target = now + us;
+  if (inIsr) {
+    return;
+  }
+  while (true) {
+    unsigned long next = target;
+    int which = -1;
+    for (int i = 0; i < nScheduled; i++) {
+      if ((long)(scheduled[i].t - next) <= 0) {
+        next = scheduled[i].t;
+        which = i;
+      }
+    }
+    bool timer = timerArmed && (long)(timerAt - next) <= 0;
+    if (timer) {
+      next = timerAt;
+    }
+    bool decode = frameActive && !ctrlLow && (long)(frameEdges[nFrameEdges - 1] + 3 * HB - next) <= 0;
+    if (decode) {
+      next = frameEdges[nFrameEdges - 1] + 3 * HB;
+      timer = false;
+      which = -1;
+    }
+    if (which < 0 && !timer && !decode) {
+      break;
+    }
+    if ((long)(next - now) > 0) {
+      now = next;
+    }
+    if (decode) {
+      decodeFrame();
+    } else if (timer) {
+      timerArmed = false;
+      inIsr = true;
+      timerIsr();
+      inIsr = false;
+    } else {
+      gearLow += scheduled[which].drive;
+      scheduled[which] = scheduled[--nScheduled];
+      updateBus();
+    }
+  }
+  now = target;
+}
+
+void pinMode(int pin, int mode) {
+  if (mode == OUTPUT) {
+    pinOut = pin;
+  }
+}
+
+void digitalWrite(int pin, int val) {
+  if (pin != pinOut) {
+    return;
+  }
+  bool low = val == HIGH; // The output is inverted: driving it high pulls the bus low
+  if (low == ctrlLow) {
+    return;
+  }
+  ctrlLow = low;
+  if (!frameActive) {
+    frameActive = true;
+    nFrameEdges = 0;
+  }
+  if (nFrameEdges < MAX_EDGES) {
+    frameEdges[nFrameEdges] = now;
+    frameLevels[nFrameEdges] = low;
+    nFrameEdges++;
+  }
+  updateBus();
+}
+
+int digitalRead(int) {
+  // The input is inverted too
+  return busLow ? HIGH : LOW;
+}
+
+int digitalPinToInterrupt(int pin) {
+  return pin;
+}
+
+void attachInterrupt(int, void (*isr)(void), int) {
+  inputIsr = isr;
+}
+
+void timer1_attachInterrupt(void (*isr)(void)) {
+  timerIsr = isr;
+}
+
+void timer1_enable(int, int, int) {
+}
+
+void timer1_write(uint32_t ticks) {
+  // TIM_DIV256 at 80MHz is 3.2us per tick
+  timerAt = now + ticks * 16 / 5;
+  timerArmed = true;
+}
+
+void timer1_disable(void) {
+  timerArmed = false;
+}
+
+unsigned long micros(void) {
+  advance(2);
+  return now;
+}
+
+unsigned long millis(void) {
+  return micros() / 1000;
+}
+
+void delay(unsigned long ms) {
+  advance(ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+  advance(us);
+}
+
+void yield(void) {
+  advance(10);
+}
@@ -0,0 +1,32 @@
+// A simulated DALI bus for host tests.  It implements the Arduino functions in stub/Arduino.h
+// against a fake clock, decodes the forward frames the library sends and has the fake gear
+// below answer them with backward frames, much as real gear would.
+
+#ifndef __FAKE_BUS_H
+#define __FAKE_BUS_H 1
+
+#include "Arduino.h"
+
+#define FAKE_MAX_GEAR 16
+
+// fakeGearAdd puts a lamp with the given random address (and no short address) on the bus,
+// returning its index for the calls below.
+int fakeGearAdd(uint32 randomAddr);
+void fakeGearSetGroups(int i, uint16 groups);
+void fakeGearSetFailed(int i, bool failed);
+uint16 fakeGearGroups(int i);
+// fakeGearLevel returns the last level the lamp was sent by DAPC
+byte fakeGearLevel(int i);
+// fakeGearShortAddr returns the lamp's short address, or 0xFF if it hasn't been given one
+byte fakeGearShortAddr(int i);
+// fakeGearBank0 returns the byte at loc in the lamp's memory bank 0
+byte fakeGearBank0(int i, byte loc);
+// fakeBusSend has an input device send a frame of the given number of bits, delayUs from now
+void fakeBusSend(unsigned long delayUs, uint32 frame, int bits);
+// fakeBusEventAfter has an input device send the 24-bit frame event where an answer to the
+// next forward frame matching frame would go
+void fakeBusEventAfter(uint16 frame, uint32 event);
+// fakeBusFrames returns the number of forward frames sent so far
+unsigned long fakeBusFrames(void);
+
+#endif
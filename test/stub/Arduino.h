@@ -0,0 +1,51 @@
+// Just enough of the ESP8266 Arduino core for the library to build on a host.  The functions
+// are implemented by fake_bus.cpp, which simulates a DALI bus with gear attached.
+
+#ifndef __ARDUINO_STUB_H
+#define __ARDUINO_STUB_H 1
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef uint64_t uint64;
+
+#define IRAM_ATTR
+
+// The fake bus never interrupts the code these protect, so there's nothing to mask
+inline uint32 xt_rsil(int) { return 0; }
+inline void xt_wsr_ps(uint32) {}
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+#define CHANGE 3
+
+#define TIM_DIV256 3
+#define TIM_EDGE 0
+#define TIM_SINGLE 0
+
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int val);
+int digitalRead(int pin);
+int digitalPinToInterrupt(int pin);
+void attachInterrupt(int irq, void (*isr)(void), int mode);
+
+void timer1_attachInterrupt(void (*isr)(void));
+void timer1_enable(int div, int intType, int reload);
+void timer1_write(uint32_t ticks);
+void timer1_disable(void);
+
+unsigned long micros(void);
+unsigned long millis(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield(void);
+
+#endif
@@ -0,0 +1 @@
+// dali.cpp includes this, but doesn't use anything from it on the host
@@ -0,0 +1,201 @@
+// Checks that the library never allocates memory once init() has been called, by running it
+// against the simulated bus in fake_bus.cpp with malloc and new counting allocations.
+
+#include <new>
+#include "fake_bus.h"
+#include "dali.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+static bool counting = false;
+static int allocs = 0;
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void __libc_free(void *p);
+
+void *malloc(size_t size) {
+  if (counting) {
+    allocs++;
+  }
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  if (counting) {
+    allocs++;
+  }
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+  if (counting) {
+    allocs++;
+  }
+  return __libc_realloc(p, size);
+}
+
+void free(void *p) {
+  __libc_free(p);
+}
+}
+
+void *operator new(size_t size) {
+  if (counting) {
+    allocs++;
+  }
+  void *p = __libc_malloc(size ? size : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void *p) noexcept {
+  __libc_free(p);
+}
+
+void operator delete[](void *p) noexcept {
+  __libc_free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+  __libc_free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+  __libc_free(p);
+}
+
+#define N_LAMPS 5
+
+static Dali<8, 1024> dali(4, 5);
+
+int main(void) {
+  const uint32 randomAddrs[N_LAMPS] = { 0x8a0f31, 0x00c0de, 0x5e1f00, 0xfffff0, 0x123456 };
+  int lamps[N_LAMPS];
+  for (int i = 0; i < N_LAMPS; i++) {
+    lamps[i] = fakeGearAdd(randomAddrs[i]);
+    fakeGearSetGroups(lamps[i], i < 2 ? 0x0001 : 0x0002);
+  }
+  dali.init();
+
+  counting = true;
+  daliAddr addrs[8];
+  byte n = dali.reAddressLamps(addrs, 8);
+  CHECK(n == N_LAMPS);
+  for (int i = 0; i < N_LAMPS; i++) {
+    CHECK(fakeGearShortAddr(lamps[i]) < N_LAMPS);
+  }
+  for (byte i = 0; i < n; i++) {
+    CHECK(dali.queryGroups(addrs[i], false) > 0);
+  }
+
+  byte buf[DALI_BANK0_SIZE];
+  for (int pass = 0; pass < 2; pass++) {
+    unsigned long frames = fakeBusFrames();
+    int l = dali.readMemoryBank(fakeGearShortAddr(lamps[0]) << 1, false, 0, buf, sizeof(buf));
+    CHECK(l == 0x1b);
+    for (int i = 0; i < l; i++) {
+      CHECK(buf[i] == fakeGearBank0(lamps[0], i));
+    }
+    if (pass == 1) {
+      // Bank 0 and the random address are both known, so there's nothing to send
+      CHECK(fakeBusFrames() == frames);
+    }
+  }
+
+  unsigned long frames = fakeBusFrames();
+  CHECK(dali.readMemoryBank(fakeGearShortAddr(lamps[0]) << 1, false, 1, buf, 0) == 0);
+  CHECK(fakeBusFrames() == frames);
+  CHECK(dali.readMemoryBank(7 << 1, false, 0, buf, sizeof(buf)) == -2);
+  CHECK(dali.getError() == eNoRandomAddrAns);
+
+  // Two colours, so lamps are addressed by group
+  daliColour cols[N_LAMPS];
+  for (byte i = 0; i < n; i++) {
+    cols[i].type = colTc;
+    cols[i].tc = 250;
+  }
+  CHECK(dali.sendColours(addrs, cols, n, true));
+  for (int i = 0; i < N_LAMPS; i++) {
+    byte s = fakeGearShortAddr(lamps[i]);
+    cols[s].tc = i < 2 ? 200 : 370;
+  }
+  CHECK(dali.sendColours(addrs, cols, n, true));
+
+  uint64 affected;
+  CHECK(dali.sweepQuery(msgQueryLampFailure, false, &affected));
+  CHECK(affected == 0);
+  fakeGearSetFailed(lamps[3], true);
+  CHECK(dali.sweepQuery(msgQueryLampFailure, false, &affected));
+  CHECK(affected == (uint64)1 << fakeGearShortAddr(lamps[3]));
+  CHECK(!dali.assignBisectionGroups(11, false) && dali.getError() == eTooFewGroups);
+  CHECK(dali.assignBisectionGroups(2, false));
+  for (int i = 0; i < N_LAMPS; i++) {
+    // Short addresses 0-4 need 3 bits, so groups 2-7 are used
+    byte s = fakeGearShortAddr(lamps[i]);
+    uint16 want = i < 2 ? 0x0001 : 0x0002;
+    for (int k = 0; k < 3; k++) {
+      want |= 1 << (2 + 2 * k + ((s >> k) & 1 ? 0 : 1));
+    }
+    CHECK(fakeGearGroups(lamps[i]) == want);
+  }
+  CHECK(dali.sweepQuery(msgQueryLampFailure, false, &affected));
+  CHECK(affected == (uint64)1 << fakeGearShortAddr(lamps[3]));
+
+  const char *c1, *c2;
+  size_t l1, l2;
+  uint32 cursor = dali.getLog(0, &c1, &l1, &c2, &l2);
+  CHECK(cursor > 0 && l1 + l2 > 0);
+  uint32 start = cursor - l1 - l2;
+  CHECK(!dali.logOverwritten(start));
+  for (int i = 0; i < 20; i++) {
+    dali.log("overwriting %d\n", i);
+  }
+  CHECK(dali.logOverwritten(start));
+
+  daliEvent ev;
+  CHECK(!dali.handleEvent(&ev));
+
+  // An event from an input device in the reply window isn't a lamp answering, for a broadcast...
+  const uint32 event = 0x0a8001; // Device 5, instance 0, button pressed
+  fakeGearSetFailed(lamps[3], false);
+  fakeBusEventAfter(0xFF92, event);
+  CHECK(dali.sweepQuery(msgQueryLampFailure, false, &affected));
+  CHECK(affected == 0);
+  delay(50);
+  CHECK(dali.handleEvent(&ev) && ev.device == 5);
+  // ...or for a single lamp.  Forgetting the groups makes the sweep ask every lamp in turn, and
+  // the event follows the last of those so it doesn't hold up the next query.
+  CHECK(dali.reAddressLamps(addrs, 8) == N_LAMPS);
+  fakeGearSetFailed(lamps[0], true);
+  fakeBusEventAfter(((N_LAMPS - 1) << 9) | 0x0192, event);
+  CHECK(dali.sweepQuery(msgQueryLampFailure, false, &affected));
+  CHECK(affected == (uint64)1 << fakeGearShortAddr(lamps[0]));
+  delay(50);
+  CHECK(dali.handleEvent(&ev) && ev.device == 5);
+  counting = false;
+
+  printf("%d allocations over %lu forward frames\n", allocs, fakeBusFrames());
+  CHECK(allocs == 0);
+  if (failures) {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  printf("alloc: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,127 @@
+// Checks that event frames from input devices are decoded for every event scheme, that commands
+// from other controllers aren't taken for events, and that event rules match as they should.
+// The frames are sent on the simulated bus in fake_bus.cpp, so they go through the ISRs.
+
+#include "fake_bus.h"
+#include "dali.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+static Dali<4, 1024> dali(4, 5);
+
+// receive has an input device send frame, then returns whether an event was queued for it
+static bool receive(uint32 frame, daliEvent *ev) {
+  fakeBusSend(1000, frame, 24);
+  delay(30); // 24 bits at 833us, plus the stop bit
+  return dali.handleEvent(ev);
+}
+
+static void testSchemes(void) {
+  daliEvent ev;
+
+  // 0AAAAAA0 0TTTTTEE EEEEEEEE
+  CHECK(receive((5 << 17) | (instPushButton << 10) | btnShortPress, &ev));
+  CHECK(ev.scheme == evSchemeDevice);
+  CHECK(ev.device == 5 && ev.instType == instPushButton);
+  CHECK(ev.group == -1 && ev.instNum == -1);
+  CHECK(ev.info == btnShortPress);
+
+  // 0AAAAAA0 1NNNNNEE EEEEEEEE
+  CHECK(receive((62 << 17) | 0x8000 | (21 << 10) | 0x3ff, &ev));
+  CHECK(ev.scheme == evSchemeDeviceInstance);
+  CHECK(ev.device == 62 && ev.instNum == 21);
+  CHECK(ev.group == -1 && ev.instType == -1);
+  CHECK(ev.info == 0x3ff);
+
+  // 10GGGGG0 0TTTTTEE EEEEEEEE
+  CHECK(receive(0x800000 | (17 << 17) | (instOccupancySensor << 10) | 0x155, &ev));
+  CHECK(ev.scheme == evSchemeDeviceGroup);
+  CHECK(ev.group == 17 && ev.instType == instOccupancySensor);
+  CHECK(ev.device == -1 && ev.instNum == -1);
+  CHECK(ev.info == 0x155);
+
+  // 11TTTTT0 0NNNNNEE EEEEEEEE
+  CHECK(receive(0xc00000 | (instLightSensor << 17) | (2 << 10) | 0x2aa, &ev));
+  CHECK(ev.scheme == evSchemeInstance);
+  CHECK(ev.instType == instLightSensor && ev.instNum == 2);
+  CHECK(ev.device == -1 && ev.group == -1);
+  CHECK(ev.info == 0x2aa);
+
+  // 11GGGGG0 1TTTTTEE EEEEEEEE
+  CHECK(receive(0xc00000 | (30 << 17) | 0x8000 | (instPushButton << 10) | btnLongPressStart, &ev));
+  CHECK(ev.scheme == evSchemeInstanceGroup);
+  CHECK(ev.group == 30 && ev.instType == instPushButton);
+  CHECK(ev.device == -1 && ev.instNum == -1);
+  CHECK(ev.info == btnLongPressStart);
+}
+
+static void testNotEvents(void) {
+  daliEvent ev;
+  // Commands to input devices have bit 16 set: a special command, then an instance command
+  CHECK(!receive(((uint32)DALI_DEV_SPECIAL << 16) | (devDTR0 << 8) | 0x02, &ev));
+  CHECK(!receive((0x0b << 16) | (DALI_DEV_INSTANCE_ALL << 8) | devEnableInstance, &ev));
+}
+
+static void testRules(int lamp) {
+  daliEvent ev;
+  const uint32 dev9inst3 = (9 << 17) | 0x8000 | (3 << 10);
+
+  // Matches any device and instance
+  daliEventRule rule = { -1, -1, btnShortPress, DaliBus::broadcast, actDapc, 100 };
+  CHECK(dali.addEventRule(&rule));
+  // Different device, instance or info: mustn't match
+  daliEventRule other = { 8, -1, btnShortPress, DaliBus::broadcast, actDapc, 50 };
+  CHECK(dali.addEventRule(&other));
+  other.device = -1;
+  other.instNum = 4;
+  CHECK(dali.addEventRule(&other));
+  other.instNum = 3;
+  other.info = btnDoublePress;
+  CHECK(dali.addEventRule(&other));
+
+  CHECK(receive(dev9inst3 | btnShortPress, &ev));
+  CHECK(fakeGearLevel(lamp) == 100);
+
+  // Matches device 9, any instance
+  dali.clearEventRules();
+  rule.device = 9;
+  rule.value = 150;
+  CHECK(dali.addEventRule(&rule));
+  CHECK(receive(dev9inst3 | btnShortPress, &ev));
+  CHECK(fakeGearLevel(lamp) == 150);
+
+  // Matches instance 3 of any device
+  dali.clearEventRules();
+  rule.device = -1;
+  rule.instNum = 3;
+  rule.value = 200;
+  CHECK(dali.addEventRule(&rule));
+  CHECK(receive(dev9inst3 | btnShortPress, &ev));
+  CHECK(fakeGearLevel(lamp) == 200);
+  CHECK(receive((9 << 17) | 0x8000 | (2 << 10) | btnShortPress, &ev));
+  CHECK(fakeGearLevel(lamp) == 200);
+  dali.clearEventRules();
+}
+
+int main(void) {
+  int lamp = fakeGearAdd(0x123456);
+  dali.init();
+
+  testSchemes();
+  testNotEvents();
+  testRules(lamp);
+
+  if (failures) {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  printf("events: all tests passed\n");
+  return 0;
+}
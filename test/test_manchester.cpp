@@ -0,0 +1,183 @@
+// Host tests and benchmark for the Manchester encoder and edge comparison used by the I2S
+// transmit backend.  Build and run with "make" in this directory.
+
+#include <stdio.h>
+#include <chrono>
+#include "manchester.h"
+
+#define HB 416 // Nominal half-bit, us
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+// toEdges converts a pattern into the edge times the receiver would log when the bus follows it
+// exactly, starting at t=1000us.  stretch is added to every low run (and taken from the
+// following high run), which is how the slow receiving hardware distorts things.
+static int toEdges(uint64_t pattern, int halfBits, unsigned long *edges, long stretch) {
+  int n = 0;
+  bool low = false;
+  for (int i = 0; i < halfBits; i++) {
+    bool bit = (pattern >> (63 - i)) & 1;
+    if (bit != low) {
+      edges[n] = 1000 + i * HB + (bit ? 0 : stretch);
+      n++;
+      low = bit;
+    }
+  }
+  if (low) {
+    edges[n++] = 1000 + halfBits * HB + stretch;
+  }
+  return n;
+}
+
+// decode reads the data bits back out of a pattern, or returns -1 if it isn't valid Manchester
+static long decode(uint64_t pattern, int halfBits) {
+  long v = 0;
+  for (int i = 0; i < halfBits; i += 2) {
+    int pair = (pattern >> (62 - i)) & 3;
+    if (pair != 1 && pair != 2) {
+      return -1;
+    }
+    v = (v << 1) | (pair == 2);
+  }
+  return v;
+}
+
+static void testEncode16(void) {
+  uint64_t p;
+  CHECK(manchesterEncode(0xFF00, 16, &p) == 34);
+  // Start bit 10, 8 ones (10 each), 8 zeros (01 each)
+  CHECK(p == 0xAAAA955540000000ULL);
+  const uint32_t frames[] = { 0x0000, 0xFFFF, 0xA55A, 0x1234, 0xFF90, 0x0190 };
+  for (uint32_t f : frames) {
+    int n = manchesterEncode(f, 16, &p);
+    CHECK(n == 34);
+    CHECK(decode(p, n) == (long)(f | 0x10000)); // Start bit is a leading one
+    CHECK((p << n) == 0); // Nothing after the frame
+  }
+}
+
+static void testEncode24(void) {
+  uint64_t p;
+  const uint32_t frames[] = { 0x000000, 0xFFFFFF, 0xC10203, 0x7F00FF, 0x0AB4C3 };
+  for (uint32_t f : frames) {
+    int n = manchesterEncode(f, 24, &p);
+    CHECK(n == 50);
+    CHECK(decode(p, n) == (long)(f | 0x1000000));
+    CHECK((p << n) == 0);
+  }
+}
+
+static void testRoundTrip(void) {
+  unsigned long edges[64];
+  uint64_t p;
+  const uint32_t frames[] = { 0x0000, 0xFFFF, 0xA55A, 0x1234, 0xFF90, 0xFEFE };
+  for (uint32_t f : frames) {
+    int n = manchesterEncode(f, 16, &p);
+    int ne = toEdges(p, n, edges, 0);
+    CHECK(manchesterCompare(p, n, edges, ne, HB) == -1);
+    // Each single-bit difference is found at that bit's first half-bit
+    for (int bit = 0; bit < 16; bit++) {
+      uint64_t q;
+      manchesterEncode(f ^ (1u << bit), 16, &q);
+      CHECK(manchesterCompare(q, n, edges, ne, HB) == 2 + 2 * (15 - bit));
+    }
+  }
+  const uint32_t frames24[] = { 0xC10203, 0x0AB4C3 };
+  for (uint32_t f : frames24) {
+    int n = manchesterEncode(f, 24, &p);
+    int ne = toEdges(p, n, edges, 0);
+    CHECK(manchesterCompare(p, n, edges, ne, HB) == -1);
+  }
+}
+
+static void testTolerance(void) {
+  unsigned long edges[64];
+  uint64_t p;
+  int n = manchesterEncode(0xA55A, 16, &p);
+  // Slack is 30% of a half-bit, 124us for 416us
+  int ne = toEdges(p, n, edges, 124);
+  CHECK(manchesterCompare(p, n, edges, ne, HB) == -1);
+  ne = toEdges(p, n, edges, -124);
+  CHECK(manchesterCompare(p, n, edges, ne, HB) == -1);
+  ne = toEdges(p, n, edges, 125);
+  CHECK(manchesterCompare(p, n, edges, ne, HB) == 0);
+  ne = toEdges(p, n, edges, -125);
+  CHECK(manchesterCompare(p, n, edges, ne, HB) == 0);
+  // A run of three half-bits is never valid Manchester
+  n = manchesterEncode(0xFFFF, 16, &p);
+  ne = toEdges(p, n, edges, 0);
+  edges[1] += 2 * HB;
+  CHECK(manchesterCompare(p, n, edges, ne, HB) == 0);
+}
+
+static void testFinalEdge(void) {
+  unsigned long edges[64];
+  uint64_t p;
+  // Ending in a zero (high then low) needs a final rising edge at the end of the frame
+  int n = manchesterEncode(0xFFFE, 16, &p);
+  int ne = toEdges(p, n, edges, 0);
+  CHECK(manchesterCompare(p, n, edges, ne, HB) == -1);
+  CHECK(manchesterCompare(p, n, edges, ne - 1, HB) == n - 1);
+  // Ending in a one (low then high) ends on a rising edge mid-bit, then stays idle.  Without
+  // that edge, the bus is still low at the end of the last bit's first half.
+  n = manchesterEncode(0xFFFF, 16, &p);
+  ne = toEdges(p, n, edges, 0);
+  CHECK(manchesterCompare(p, n, edges, ne, HB) == -1);
+  CHECK(manchesterCompare(p, n, edges, ne - 1, HB) == n - 2);
+  // Activity after the frame, e.g. another controller starting
+  edges[ne] = edges[ne - 1] + 3 * HB;
+  edges[ne + 1] = edges[ne] + HB;
+  CHECK(manchesterCompare(p, n, edges, ne + 2, HB) == n);
+  // ...even if it starts right as the frame ends
+  edges[ne] = edges[ne - 1] + HB;
+  edges[ne + 1] = edges[ne] + HB;
+  CHECK(manchesterCompare(p, n, edges, ne + 2, HB) == n);
+  // Nothing seen at all
+  CHECK(manchesterCompare(p, n, edges, 0, HB) == 0);
+}
+
+static void benchmark(void) {
+  const int iterations = 10000000;
+  uint64_t p;
+  volatile uint64_t sink = 0;
+  auto t0 = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    manchesterEncode(i & 0xFFFFFF, 24, &p);
+    sink = sink + p;
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  unsigned long edges[64];
+  int n = manchesterEncode(0xA55A, 16, &p);
+  int ne = toEdges(p, n, edges, 60);
+  volatile int r = 0;
+  for (int i = 0; i < iterations; i++) {
+    r = r + manchesterCompare(p, n, edges, ne, HB);
+  }
+  auto t2 = std::chrono::steady_clock::now();
+  printf("manchesterEncode (24 bits): %.1f ns\n",
+         std::chrono::duration<double, std::nano>(t1 - t0).count() / iterations);
+  printf("manchesterCompare (16 bits): %.1f ns\n",
+         std::chrono::duration<double, std::nano>(t2 - t1).count() / iterations);
+}
+
+int main(void) {
+  testEncode16();
+  testEncode24();
+  testRoundTrip();
+  testTolerance();
+  testFinalEdge();
+  if (failures) {
+    printf("%d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("manchester: all tests passed\n");
+  benchmark();
+  return 0;
+}